@@ -0,0 +1,587 @@
+/*
+ * uds-bench - Load generator for uds-server
+ *
+ * Plays the diagnostic tool side over a (v)can interface: sends requests
+ * from a weighted mix, does the tester half of ISO-TP (flow control,
+ * reassembly) and measures how long every answer takes.
+ *
+ * (c) 2015 Open Garages
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "uds-server.h"
+
+#define DEFAULT_DURATION  10   // Seconds
+#define DEFAULT_TIMEOUT   1000 // ms
+#define RX_BATCH          64
+#define SEND_RETRY_US     1000 // Wait after a failed write
+#define MAX_TARGETS       8
+#define BENCH_PAD_BYTE    0x55
+#define UDS_NRC_RESPONSE_PENDING 0x78
+
+/* How the reply to a request type comes back */
+#define REPLY_ISOTP       0 // ISO-TP on the module's response ID
+#define REPLY_GM_DATA     1 // GM 0xAA: one raw frame per DID on 0x500 + ID
+#define REPLY_GM_DTC      2 // GM 0xA9: raw DTC frames until the 0xFF status
+
+/* Something we know how to ask for and what a good answer looks like */
+struct bench_type {
+  char *name; // As used with -m
+  char *desc;
+  int req_id;
+  int resp_id;
+  int reply;
+  int len;
+  unsigned char data[8]; // Single frame request including the PCI byte
+  /* Filled in while running */
+  int weight;
+  unsigned long sent;
+  unsigned long ok;
+  unsigned long nrc;
+  unsigned long timeouts;
+  unsigned long malformed;
+  uint32_t *lat; // Microseconds, one per answered request
+  unsigned long nlat;
+  unsigned long lat_size;
+};
+
+struct bench_type types[] = {
+  { .name = "01", .desc = "OBD Mode 01 supported PIDs", .req_id = 0x7E0, .resp_id = 0x7E8, .reply = REPLY_ISOTP, .len = 3, .data = { 0x02, 0x01, 0x00 } },
+  { .name = "03", .desc = "OBD Mode 03 stored DTCs", .req_id = 0x7E0, .resp_id = 0x7E8, .reply = REPLY_ISOTP, .len = 2, .data = { 0x01, 0x03 } },
+  { .name = "09", .desc = "OBD Mode 09 VIN", .req_id = 0x7E0, .resp_id = 0x7E8, .reply = REPLY_ISOTP, .len = 3, .data = { 0x02, 0x09, 0x02 } },
+  { .name = "22", .desc = "UDS 0x22 ReadDataByID F1A2", .req_id = 0x7E0, .resp_id = 0x7E8, .reply = REPLY_ISOTP, .len = 4, .data = { 0x03, 0x22, 0xF1, 0xA2 } },
+  { .name = "3E", .desc = "UDS 0x3E TesterPresent", .req_id = 0x7E0, .resp_id = 0x7E8, .reply = REPLY_ISOTP, .len = 3, .data = { 0x02, 0x3E, 0x00 } },
+  { .name = "1A", .desc = "GM 0x1A Read DID VIN", .req_id = 0x244, .resp_id = 0x644, .reply = REPLY_ISOTP, .len = 3, .data = { 0x02, 0x1A, 0x90 } },
+  { .name = "A9", .desc = "GM 0xA9 Read DTCs by mask", .req_id = 0x244, .resp_id = 0x644, .reply = REPLY_GM_DTC, .len = 4, .data = { 0x03, 0xA9, 0x81, 0x12 } },
+  { .name = "AA", .desc = "GM 0xAA Read data one shot", .req_id = 0x244, .resp_id = 0x644, .reply = REPLY_GM_DATA, .len = 4, .data = { 0x03, 0xAA, 0x01, 0x07 } },
+  { .name = "710", .desc = "VCDS 0x710 0x22 F187", .req_id = 0x710, .resp_id = 0x77A, .reply = REPLY_ISOTP, .len = 4, .data = { 0x03, 0x22, 0xF1, 0x87 } },
+  { .name = NULL }
+};
+
+/* One module we talk to.  Only one request per module is in flight at a
+   time, otherwise answers could not be told apart */
+struct bench_target {
+  int req_id;
+  int resp_id;
+  int uudt_id;  // GM raw replies
+  struct bench_type *cur; // NULL when idle
+  uint64_t sent_at;
+  uint64_t deadline;
+  unsigned char buf[ISOTP_FF_DL_MAX + 1];
+  int size;
+  int received;
+  int seq;
+  int block_left;
+};
+
+struct bench_target targets[MAX_TARGETS];
+int ntargets = 0;
+int total_weight = 0;
+volatile int running = 1;
+int verbose = 0;
+int fc_bs = 0;
+int fc_stmin = 0;
+unsigned long unexpected = 0;
+unsigned long tx_errors = 0;
+
+void usage(char *app, char *msg) {
+  struct bench_type *t;
+  printf("Load generator for uds-server\n");
+  if (msg) printf("%s\n", msg);
+  printf("Usage: %s [options] <can_interface>\n", app);
+  printf("\t-m <mix>\tRequest mix, ex: 01:10,09:1,3E:5 (Default: all, equal weights)\n");
+  printf("\t-r <req/s>\tTarget request rate (Default: 0, as fast as answers come)\n");
+  printf("\t-c <count>\tRequests in flight, at most one per module (Default: 1)\n");
+  printf("\t-d <seconds>\tRun time (Default: %d)\n", DEFAULT_DURATION);
+  printf("\t-n <count>\tStop after this many requests\n");
+  printf("\t-T <ms>\t\tResponse timeout (Default: %d)\n", DEFAULT_TIMEOUT);
+  printf("\t-B <bs>\t\tBlock size in our flow control (Default: 0)\n");
+  printf("\t-s <stmin>\tSTmin byte in our flow control (Default: 0)\n");
+  printf("\t-R <seed>\tSeed for the request order (Default: 1)\n");
+  printf("\t-v\t\tVerbose\n");
+  printf("\nRequest types:\n");
+  for(t = types; t->name; t++) printf("\t%-4s\t%03X  %s\n", t->name, t->req_id, t->desc);
+  printf("\n");
+  exit(1);
+}
+
+void intHandler(int sig) {
+  running = 0;
+}
+
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct bench_type *find_type(char *name) {
+  struct bench_type *t;
+  for(t = types; t->name; t++) {
+    if(!strcasecmp(t->name, name)) return t;
+  }
+  return NULL;
+}
+
+// name[:weight],...  Returns -1 on an unknown name
+int parse_mix(char *mix) {
+  struct bench_type *t;
+  char *tok, *w;
+  for(tok = strtok(mix, ","); tok; tok = strtok(NULL, ",")) {
+    w = strchr(tok, ':');
+    if(w) *w++ = 0;
+    t = find_type(tok);
+    if(!t) {
+      fprintf(stderr, "Unknown request type %s\n", tok);
+      return -1;
+    }
+    t->weight = w ? atoi(w) : 1;
+  }
+  return 0;
+}
+
+struct bench_target *get_target(struct bench_type *t) {
+  int i;
+  for(i = 0; i < ntargets; i++) {
+    if(targets[i].req_id == t->req_id) return &targets[i];
+  }
+  if(ntargets == MAX_TARGETS) return NULL;
+  memset(&targets[ntargets], 0, sizeof(struct bench_target));
+  targets[ntargets].req_id = t->req_id;
+  targets[ntargets].resp_id = t->resp_id;
+  // Same mapping uds-server uses for GM raw replies
+  targets[ntargets].uudt_id = t->req_id == 0x7E0 ? 0x5E8 : 0x500 + (t->req_id & 0xFF);
+  return &targets[ntargets++];
+}
+
+// Draws from the mix, leaving out modules that already have a request in
+// flight so -c can keep them all busy.  NULL when none is idle
+struct bench_type *pick_type() {
+  struct bench_type *t;
+  int total = 0, r;
+  for(t = types; t->name; t++) {
+    if(t->weight > 0 && !get_target(t)->cur) total += t->weight;
+  }
+  if(!total) return NULL;
+  r = rand() % total;
+  for(t = types; t->name; t++) {
+    if(t->weight <= 0 || get_target(t)->cur) continue;
+    if(r < t->weight) return t;
+    r -= t->weight;
+  }
+  return NULL;
+}
+
+void lat_add(struct bench_type *t, uint64_t us) {
+  uint32_t *lat;
+  if(t->nlat == t->lat_size) {
+    t->lat_size = t->lat_size ? t->lat_size * 2 : 4096;
+    lat = realloc(t->lat, t->lat_size * sizeof(uint32_t));
+    if(!lat) {
+      perror("lat_add");
+      exit(1);
+    }
+    t->lat = lat;
+  }
+  t->lat[t->nlat++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+int send_frame(int can, canid_t id, unsigned char *data, int len) {
+  struct can_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = id;
+  frame.can_dlc = 8;
+  memset(frame.data, BENCH_PAD_BYTE, 8);
+  memcpy(frame.data, data, len);
+  if(write(can, &frame, CAN_MTU) != CAN_MTU) {
+    tx_errors++;
+    return -1;
+  }
+  return 0;
+}
+
+void send_fc(int can, struct bench_target *tg) {
+  unsigned char fc[3] = { ISOTP_FLOW_CONTROL | ISOTP_FC_CTS, fc_bs, fc_stmin };
+  send_frame(can, tg->req_id, fc, 3);
+  tg->block_left = fc_bs;
+}
+
+// Returns -1 if the request didn't go out, it is not counted then
+int send_request(int can, struct bench_target *tg, struct bench_type *t) {
+  if(send_frame(can, t->req_id, t->data, t->len) < 0) return -1;
+  tg->cur = t;
+  tg->size = 0;
+  tg->received = 0;
+  tg->sent_at = now_us();
+  tg->deadline = 0;
+  t->sent++;
+  return 0;
+}
+
+// The request on this module is done, one way or another
+void finish(struct bench_target *tg, int ok) {
+  struct bench_type *t = tg->cur;
+  if(ok) {
+    t->ok++;
+    lat_add(t, now_us() - tg->sent_at);
+  }
+  tg->cur = NULL;
+}
+
+void bad_reply(struct bench_target *tg, char *why) {
+  if(verbose) printf("%s: Malformed reply, %s\n", tg->cur->name, why);
+  tg->cur->malformed++;
+  tg->cur = NULL;
+}
+
+// A complete ISO-TP payload for the request on tg
+void check_reply(struct bench_target *tg, unsigned char *data, int len) {
+  int sid = tg->cur->data[1];
+  if(len >= 3 && data[0] == 0x7F && data[1] == sid) {
+    if(data[2] == UDS_NRC_RESPONSE_PENDING) return; // Keep waiting
+    tg->cur->nrc++;
+    finish(tg, 1);
+  } else if(len >= 1 && data[0] == sid + 0x40) {
+    finish(tg, 1);
+  } else {
+    bad_reply(tg, "wrong SID");
+  }
+}
+
+void isotp_frame(int can, struct bench_target *tg, struct can_frame *frame) {
+  int len;
+  if(frame->can_dlc < 1) {
+    bad_reply(tg, "empty frame");
+    return;
+  }
+  switch(frame->data[0] & 0xF0) {
+    case ISOTP_SINGLE_FRAME:
+      len = frame->data[0] & 0x0F;
+      if(len == 0 || len > frame->can_dlc - 1) {
+        bad_reply(tg, "bad single frame length");
+        return;
+      }
+      check_reply(tg, &frame->data[1], len);
+      break;
+    case ISOTP_FIRST_FRAME:
+      tg->size = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+      if(frame->can_dlc < 8 || tg->size < 8) {
+        bad_reply(tg, "bad first frame length");
+        return;
+      }
+      memcpy(tg->buf, &frame->data[2], 6);
+      tg->received = 6;
+      tg->seq = 1;
+      send_fc(can, tg);
+      break;
+    case ISOTP_CONSECUTIVE_FRAME:
+      if(!tg->size) {
+        bad_reply(tg, "consecutive frame without a first frame");
+        return;
+      }
+      if((frame->data[0] & 0x0F) != tg->seq) {
+        bad_reply(tg, "wrong sequence number");
+        return;
+      }
+      len = tg->size - tg->received;
+      if(len > frame->can_dlc - 1) len = frame->can_dlc - 1;
+      memcpy(&tg->buf[tg->received], &frame->data[1], len);
+      tg->received += len;
+      tg->seq = (tg->seq + 1) & 0x0F;
+      if(tg->received >= tg->size) {
+        check_reply(tg, tg->buf, tg->size);
+      } else if(fc_bs && --tg->block_left == 0) {
+        send_fc(can, tg);
+      }
+      break;
+    default:
+      bad_reply(tg, "unexpected PCI");
+      break;
+  }
+}
+
+void gm_frame(struct bench_target *tg, struct can_frame *frame) {
+  struct bench_type *t = tg->cur;
+  // Data replies lead with the DPID, DTC frames are subfunction, DTC and status
+  if(frame->can_dlc < (t->reply == REPLY_GM_DTC ? 5 : 1)) {
+    bad_reply(tg, "short frame");
+    return;
+  }
+  if(t->reply == REPLY_GM_DATA) {
+    if(frame->data[0] == t->data[3]) finish(tg, 1);
+    else bad_reply(tg, "wrong DID");
+  } else if(t->reply == REPLY_GM_DTC) {
+    if(frame->data[0] != t->data[2]) bad_reply(tg, "wrong subfunction");
+    else if(frame->data[4] == 0xFF) finish(tg, 1);
+  }
+}
+
+void handle_frame(int can, struct can_frame *frame) {
+  struct bench_target *tg;
+  int i;
+  for(i = 0; i < ntargets; i++) {
+    tg = &targets[i];
+    if(frame->can_id == tg->resp_id) {
+      if(tg->cur) isotp_frame(can, tg, frame);
+      else unexpected++;
+      return;
+    }
+    if(frame->can_id == tg->uudt_id) {
+      if(tg->cur && tg->cur->reply != REPLY_ISOTP) gm_frame(tg, frame);
+      else unexpected++;
+      return;
+    }
+  }
+  unexpected++;
+}
+
+void install_filters(int can) {
+  struct can_filter filters[MAX_TARGETS * 2];
+  int i;
+  for(i = 0; i < ntargets; i++) {
+    filters[i * 2].can_id = targets[i].resp_id;
+    filters[i * 2].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+    filters[i * 2 + 1].can_id = targets[i].uudt_id;
+    filters[i * 2 + 1].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+  }
+  if(setsockopt(can, SOL_CAN_RAW, CAN_RAW_FILTER, filters, ntargets * 2 * sizeof(struct can_filter)) < 0)
+    perror("CAN_RAW_FILTER");
+}
+
+int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+uint32_t percentile(uint32_t *lat, unsigned long n, double pct) {
+  unsigned long i = n * pct / 100.0;
+  if(i >= n) i = n - 1;
+  return lat[i];
+}
+
+void print_lat(char *name, uint32_t *lat, unsigned long n) {
+  double sum = 0;
+  unsigned long i;
+  if(!n) return;
+  qsort(lat, n, sizeof(uint32_t), cmp_u32);
+  for(i = 0; i < n; i++) sum += lat[i];
+  printf("  %-5s min=%u p50=%u p90=%u p99=%u p99.9=%u max=%u avg=%.1f (us)\n", name, lat[0],
+         percentile(lat, n, 50), percentile(lat, n, 90), percentile(lat, n, 99),
+         percentile(lat, n, 99.9), lat[n - 1], sum / n);
+}
+
+void report(double secs) {
+  struct bench_type *t;
+  unsigned long sent = 0, ok = 0, nrc = 0, timeouts = 0, malformed = 0, n = 0;
+  uint32_t *all;
+  for(t = types; t->name; t++) {
+    sent += t->sent;
+    ok += t->ok;
+    nrc += t->nrc;
+    timeouts += t->timeouts;
+    malformed += t->malformed;
+    n += t->nlat;
+  }
+  printf("Sent %lu requests in %.2fs\n", sent, secs);
+  printf("Answered %lu (%.1f req/s), %lu negative, %lu timeouts, %lu malformed, %lu unexpected frames, %lu write errors\n",
+         ok, secs > 0 ? ok / secs : 0, nrc, timeouts, malformed, unexpected, tx_errors);
+  all = malloc((n ? n : 1) * sizeof(uint32_t));
+  if(!all) return;
+  for(n = 0, t = types; t->name; t++) {
+    memcpy(&all[n], t->lat, t->nlat * sizeof(uint32_t));
+    n += t->nlat;
+  }
+  print_lat("all", all, n);
+  free(all);
+  for(t = types; t->name; t++) {
+    if(!t->sent) continue;
+    printf("%-4s %-30s sent=%lu ok=%lu nrc=%lu timeouts=%lu malformed=%lu\n", t->name, t->desc,
+           t->sent, t->ok, t->nrc, t->timeouts, t->malformed);
+    print_lat("", t->lat, t->nlat);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_type *t;
+  struct bench_target *tg;
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  struct can_frame frames[RX_BATCH];
+  struct mmsghdr msgs[RX_BATCH];
+  struct iovec iov[RX_BATCH];
+  struct pollfd pfd;
+  struct timespec ts;
+  struct sigaction act;
+  char *mix = NULL;
+  int duration = DEFAULT_DURATION;
+  int timeout_ms = DEFAULT_TIMEOUT;
+  int concurrency = 1;
+  unsigned long max_reqs = 0, sent = 0;
+  unsigned int seed = 1;
+  double rate = 0;
+  uint64_t start, end, now, next_send, wake, retry_at = 0;
+  int can, opt, i, n, inflight;
+
+  while ((opt = getopt(argc, argv, "m:r:c:d:n:T:B:s:R:vh?")) != -1) {
+    switch(opt) {
+      case 'm':
+        mix = optarg;
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      case 'c':
+        concurrency = atoi(optarg);
+        if(concurrency < 1) usage(argv[0], "Need at least one request in flight");
+        break;
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'n':
+        max_reqs = strtoul(optarg, NULL, 0);
+        break;
+      case 'T':
+        timeout_ms = atoi(optarg);
+        break;
+      case 'B':
+        fc_bs = atoi(optarg) & 0xFF;
+        break;
+      case 's':
+        fc_stmin = strtol(optarg, NULL, 0) & 0xFF;
+        break;
+      case 'R':
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        verbose++;
+        break;
+      case 'h':
+      case '?':
+      default:
+        usage(argv[0], NULL);
+        break;
+    }
+  }
+  if (optind >= argc) usage(argv[0], "You must specify a can device");
+
+  if(mix) {
+    if(parse_mix(mix) < 0) usage(argv[0], NULL);
+  } else {
+    for(t = types; t->name; t++) t->weight = 1;
+  }
+  for(t = types; t->name; t++) {
+    if(t->weight <= 0) continue;
+    total_weight += t->weight;
+    if(!get_target(t)) usage(argv[0], "Too many modules in the mix");
+  }
+  if(!total_weight) usage(argv[0], "Empty request mix");
+  srand(seed);
+
+  can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(can < 0) {
+    perror("socket");
+    return 1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, argv[optind], sizeof(ifr.ifr_name) - 1);
+  if (ioctl(can, SIOCGIFINDEX, &ifr) < 0) {
+    perror("SIOCGIFINDEX");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+  install_filters(can);
+
+  memset(msgs, 0, sizeof(msgs));
+  for(i = 0; i < RX_BATCH; i++) {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = intHandler;
+  sigaction(SIGINT, &act, NULL);
+
+  pfd.fd = can;
+  pfd.events = POLLIN;
+  start = now_us();
+  end = start + (uint64_t)duration * 1000000;
+  next_send = start;
+  while(running) {
+    now = now_us();
+    if(now >= end) break;
+    // Timeouts
+    for(i = 0, inflight = 0; i < ntargets; i++) {
+      tg = &targets[i];
+      if(!tg->cur) continue;
+      if(now - tg->sent_at >= (uint64_t)timeout_ms * 1000) {
+        if(verbose) printf("%s: Timeout\n", tg->cur->name);
+        tg->cur->timeouts++;
+        tg->cur = NULL;
+      } else {
+        inflight++;
+      }
+    }
+    // Closed loop: a request only goes out once its module has answered
+    while(!max_reqs || sent < max_reqs) {
+      if(inflight >= concurrency) break;
+      if(rate > 0 && now < next_send) break;
+      if(now < retry_at) break;
+      if(!(t = pick_type())) break; // Every module is busy
+      tg = get_target(t);
+      if(send_request(can, tg, t) < 0) {
+        retry_at = now + SEND_RETRY_US; // TX queue full, don't spin on it
+        break;
+      }
+      sent++;
+      inflight++;
+      if(rate > 0) {
+        next_send += 1000000 / rate;
+        if(next_send < now) next_send = now; // Don't burst to catch up
+      }
+    }
+    if(max_reqs && sent >= max_reqs && !inflight) break;
+    // Sleep until a frame, the next send or the nearest timeout
+    wake = end;
+    if(rate > 0 && next_send > now && next_send < wake) wake = next_send;
+    if(retry_at > now && retry_at < wake) wake = retry_at;
+    for(i = 0; i < ntargets; i++) {
+      tg = &targets[i];
+      if(tg->cur && tg->sent_at + (uint64_t)timeout_ms * 1000 < wake) wake = tg->sent_at + (uint64_t)timeout_ms * 1000;
+    }
+    ts.tv_sec = wake > now ? (wake - now) / 1000000 : 0;
+    ts.tv_nsec = wake > now ? ((wake - now) % 1000000) * 1000 : 0;
+    if(ppoll(&pfd, 1, &ts, NULL) <= 0) continue;
+    n = recvmmsg(can, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+    for(i = 0; i < n; i++) {
+      if(msgs[i].msg_len == CAN_MTU) handle_frame(can, &frames[i]);
+    }
+  }
+
+  report((now_us() - start) / 1000000.0);
+  close(can);
+  return 0;
+}
@@ -4,17 +4,27 @@
  * (c) 2014 Open Garages - Craig Smith <craig@theialabs.com>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <net/if.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
@@ -29,29 +39,174 @@
 #define DATA_ALPHA     0
 #define DATA_ALPHANUM  1
 #define DATA_BINARY    2
+#define DEFAULT_RX_BATCH 32
+#define MAX_RX_BATCH     1024
+#define TX_BATCH         64
+#define ISOTP_PAD_BYTE   0xCC
+#define MAX_EVENTS       8
+#define MAX_LEARN_FILES  16
+#define MAX_IMAGES       16
+#define PROFILE_LINE_MAX (ISOTP_FF_DL_MAX * 3 + 64)
+#define PERIODIC_SLOW_MS   1000
+#define PERIODIC_MEDIUM_MS 100
+#define PERIODIC_FAST_MS   20
+#define GM_DTC_FIRST_MS    200  // After the first DTC, instead of waiting for a FC
+#define GM_DTC_GAP_MS      1000 // Between fuzzed DTCs
+#define GM_DATA_GAP_MS     500  // Between GM one response frames
+#define RX_CTRLMSG_SIZE  (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(__u32)))
 
 /* Globals */
 int running = 0;
 int verbose = 0;
 int no_flow_control = 0;
+int can_fd = 0;
 int fuzz_level = 0;
 int keep_spec = 0;
+uint64_t fuzz_seed = 0;
+unsigned long fuzz_case = 0;
+struct fuzz_rng fuzz_rng;
 FILE *plogfp = NULL;
 char *vin = VIN;
-struct timeval start_tv;
-int pending_data;
-struct can_frame gm_data_by_id;
-long gm_lastcms = 0;
+struct ecu *ecu_by_id[MAX_CAN_ID];
+int filters_dirty = 1;
+int no_filters = 0;
 
-/* This is for flow control packets */
-char gBuffer[255];
-int gBufSize;
-int gBufLengthRemaining;
-int gBufCounter;
+/* Batched receive buffers, one slot per frame */
+int rx_batch = DEFAULT_RX_BATCH;
+struct canfd_frame *rx_frames;
+struct iovec *rx_iov;
+struct mmsghdr *rx_msgs;
+struct sockaddr_can *rx_addrs;
+char *rx_ctrlmsgs;
+unsigned long rx_wakeups = 0;
+unsigned long rx_total = 0;
+__u32 rx_kernel_drops = 0; // From SO_RXQ_OVFL
+
+/* Request to response latency */
+struct lat_entry *lat_table[LAT_TABLE_SIZE];
+uint64_t rx_ts[MAX_RX_BATCH];  // Kernel receive time of each frame in the batch
+uint64_t rx_cur_ts = 0;        // Receive time of the frame being handled
+struct lat_entry *lat_cur = NULL; // Request being dispatched
+uint64_t lat_cur_ts = 0;
+int lat_cur_sent = 0;
+int lat_cur_pending = 0;       // Reply is a multi-frame transfer still going
+volatile sig_atomic_t lat_dump_requested = 0;
+
+/* Live counters, served on the control socket */
+unsigned long rx_by_id[MAX_CAN_ID];
+unsigned long tx_by_id[MAX_CAN_ID];
+unsigned long rx_eff = 0; // 29-bit IDs are lumped together
+unsigned long tx_eff = 0;
+unsigned long req_by_sid[256];
+unsigned long nrc_sent[256];
+unsigned long unhandled_reqs = 0;
+
+/* Control socket (-S) */
+int ctl_fd = -1;
+struct ctl_client ctl_clients[CTL_MAX_CLIENTS];
+
+/* Capture file (-w) */
+int cap_fd = -1;
+unsigned char *cap_buf;
+int cap_len = 0;
+unsigned long cap_frames = 0;
+
+/* ISO-TP transfers in progress */
+struct isotp_session *isotp_sessions[ISOTP_MAX_SESSIONS];
+int isotp_nsessions = 0;
+
+/* Periodic data streams, a min-heap on the next due time */
+struct periodic **periodic_heap = NULL;
+int periodic_count = 0;
+int periodic_size = 0;
+struct fuzz_rng periodic_rng; // Bogus data, kept apart from the fuzz cases
+
+/* Streamed replies */
+struct tx_job *tx_jobs[TX_JOB_MAX];
+int tx_njobs = 0;
+
+/* How late timer driven transmits go out */
+struct jitter_stats periodic_jitter;
+struct jitter_stats job_jitter;
+struct jitter_stats isotp_jitter;
+
+/* Reply cache.  cache_fill is set while a handler's reply is recorded */
+struct resp_cache *cache_fill = NULL;
+int cache_fill_replies = 0;
+unsigned long cache_hits = 0;
+unsigned long cache_misses = 0;
+
+/* Responses learned from candump logs (-L) */
+struct resp_db_entry *resp_db = NULL;
+unsigned int resp_db_slots = 0;
+unsigned int resp_db_count = 0;
+unsigned long resp_db_hits = 0;
+
+/* Data identifier profile (-P) */
+char *did_profile = NULL;          // Written DIDs are saved back to it
+int did_dirty = 0;                 // A DID was written since the last save
+unsigned long did_writes = 0;
+
+/* Memory images (-I) */
+unsigned long mem_reads = 0;
+unsigned long long mem_read_bytes = 0;
+unsigned long mem_writes = 0;
+
+/* Downloads and uploads */
+char *xfer_dir = NULL;             // Downloads outside the images are written here (-D)
+int xfer_block_max = XFER_BLOCK_MAX;
+struct xfer_stats xfer_stats[XFER_TYPES];
+struct xfer *xfer_cur[XFER_TYPES]; // Transfer in progress, for the rate
+
+/* Fuzz campaign (-C) */
+int camp_mask = 0;                 // Enabled strategies, 0 = no campaign
+char *camp_dir = ".";              // Where findings are written
+struct camp_entry *camp_table[CAMP_TABLE_SIZE];
+struct camp_case camp_cur;         // Request being handled, until its reply is fuzzed
+int camp_cur_open = 0;
+struct camp_case camp_history[CAMP_HISTORY];
+unsigned long camp_cases = 0;
+unsigned long camp_findings = 0;
+unsigned char camp_buf[ISOTP_FF_DL_MAX];
+uint64_t camp_start_us = 0;
+uint64_t camp_busy_ns = 0;         // Handling requests that got a fuzzed reply
+uint64_t camp_begin_ns = 0;
+uint64_t camp_wait_us = 0;         // From a fuzzed reply to the tester's next frame
+uint64_t camp_waits = 0;
+uint64_t camp_last_rx = 0;         // Tester liveness, CLOCK_MONOTONIC usecs
+uint64_t camp_last_tp = 0;
+uint64_t camp_tp_gap = 0;          // Usual TesterPresent interval
+int camp_sessions = 0;             // DiagnosticSessionControl requests seen
+int camp_silent = 0;               // Already reported, cleared when the tester is back
+int camp_tp_lost = 0;
+
+/* Async logger */
+struct log_rec *log_ring;
+atomic_ulong log_head;
+atomic_ulong log_tail;
+atomic_int log_stopping;
+unsigned long log_drops = 0;
+int log_async = 0;
+int log_timestamps = 0;
+uint64_t log_start_us = 0;
+pthread_t log_thread;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // Only for sleeping on log_wake
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+/* Transmit accounting */
+unsigned long tx_frames = 0;
+unsigned long tx_calls = 0;
+unsigned long tx_errors = 0;
+int tx_last_errno = 0;
 
 /* Prototypes */
 void print_pkt(struct canfd_frame);
 void print_bin(unsigned char *, int);
+void dispatch_msg(struct transport *, struct uds_msg *, struct ecu *);
+void resp_cache_record(unsigned char *, int, int, int);
+char *sid_name(int);
+int isotp_tx_dl();
+int msg_payload_len(struct uds_msg *);
 
 
 void usage(char *app, char *msg) {
@@ -59,1366 +214,4648 @@ void usage(char *app, char *msg) {
   if (msg) printf("%s\n", msg);
   printf("Usage: %s [options] <can_interface>\n", app);
   printf("\t-z\t\tIncrease fuzz level\n");
+  printf("\t-s <seed>[:<case>]\tFuzz seed, and the case to start from\n");
+  printf("\t-C <strategies>\tFuzz campaign: all or length,seq,oversize,undersize,nrc,dtc\n");
+  printf("\t-O <dir>\tWhere the campaign saves cases that hang the tester (Default: .)\n");
   printf("\t-v\t\tVerbose\n");
   printf("\t-l <logfile>\tLog output to file instead of STDOUT\n");
   printf("\t-c\t\tDon't fuzz ISOTP Spec, just data\n");
   printf("\t-F\t\tDisable flow control (Functional Addressing)\n");
   printf("\t-V <vin>\tSpecify VIN (Default: %s)\n", VIN);
+  printf("\t-b <frames>\tMax frames read per wakeup (Default: %d)\n", DEFAULT_RX_BATCH);
+  printf("\t-A\t\tReceive all frames (No kernel CAN filters)\n");
+  printf("\t-f\t\tCAN FD mode (ISO-TP over 64 byte frames)\n");
+  printf("\t-t\t\tTimestamp log lines (Seconds since start)\n");
+  printf("\t-w <file>\tCapture all RX/TX frames to a binary file\n");
+  printf("\t-x <file>\tConvert a capture to a candump log on STDOUT\n");
+  printf("\t-X <file>\tConvert a capture to pcap on STDOUT\n");
+  printf("\t-S <path>\tControl socket for live stats and settings\n");
+  printf("\t-r <file>\tReplay the RX frames of a capture instead of a CAN interface\n");
+  printf("\t-M <count>\tRun the handler microbenchmarks (No CAN interface needed)\n");
+  printf("\t-L <log>\tAnswer with the responses recorded in a candump -l log\n");
+  printf("\t-P <profile>\tLoad data identifiers from a profile, writes are saved to it\n");
+  printf("\t-I <id>=<file>[@<addr>][,shared]\tMap a memory image for a module\n");
+  printf("\t-D <dir>\tWrite downloads that aren't to an image here (Default: drop them)\n");
+  printf("\t-T <bytes>\tLargest TransferData block to offer (Default: %d)\n", XFER_BLOCK_MAX);
   printf("\n");
   exit(1);
 }
 
-// Simple function to print logging info to screen or to a file
-void plog(char *fmt, ...) {
-  va_list args;
-  char buf[2046];
-  int len;
+void intHandler(int sig) {
+    running = 0;
+}
 
-  va_start(args, fmt);
-  len = vsnprintf(buf, 2045, fmt, args);
-  va_end(args);
+void usr1Handler(int sig) {
+    lat_dump_requested = 1;
+}
+
+// Monotonic clock in microseconds, used for all timers
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
+void log_write(char *buf, int len) {
   if(plogfp) {
     len = fwrite(buf, 1, len, plogfp);
   } else {
-    printf("%s", buf);
+    fwrite(buf, 1, len, stdout);
   }
 }
 
-void intHandler(int sig) {
-    running = 0;
+/*
+ * Logging.  Once log_start() is called the packet path only copies a
+ * compact record (format string, raw arguments or frame bytes) into a ring
+ * and a background thread does the formatting and the writes.  If the
+ * writer falls behind, records are dropped and counted; the main loop never
+ * waits on it.  Only the main thread logs, so the ring is single producer.
+ * The writer sleeps on log_wake while the ring is empty and is only
+ * signalled for the record that makes it non-empty.
+ */
+struct log_rec *log_reserve(int type) {
+  unsigned long head = atomic_load_explicit(&log_head, memory_order_relaxed);
+  struct log_rec *rec;
+  if(head - atomic_load_explicit(&log_tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+    log_drops++;
+    return NULL;
+  }
+  rec = &log_ring[head & (LOG_RING_SLOTS - 1)];
+  rec->ts = now_us();
+  rec->type = type;
+  rec->nargs = 0;
+  rec->len = 0;
+  return rec;
 }
 
-// Generates data into a buff and returns it.
-char *gen_data(int scope, int size) {
-  char *charset, *buf;
-  unsigned char byte;
-  int num;
-  int i;
-  buf = malloc(size);
-  memset(buf,0,size);
-  switch(scope) {
-    case DATA_ALPHA:
-       charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-       for(i = 0; i < size; i++) {
-         buf[i] = charset[rand() % strlen(charset)];
-       } 
-       break;
-    case DATA_ALPHANUM:
-       charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-       for(i = 0; i < size; i++) {
-         num = rand() % strlen(charset);
-         byte = charset[num];
-if (DEBUG) printf("DEBUG: random byte[%d] = %d %02X\n", i, num, byte);
-         buf[i] = byte;
-       } 
-       break;
-    case DATA_BINARY:
-       for(i = 0; i < size; i++) {
-         buf[i] = rand() % 256;
-       }
-    default:
-      break;
+void log_commit() {
+  unsigned long head = atomic_fetch_add(&log_head, 1);
+  // The writer has caught up with everything before this one, it may be asleep
+  if(atomic_load(&log_tail) == head) {
+    pthread_mutex_lock(&log_lock);
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
   }
-  return buf;
 }
 
-// If a flow control packet comes in, push out more data
-// This isn't fully supported, just a hack at the moment
-void flow_control_push_to(int can, int id) {
-  struct canfd_frame frame;
-  int nbytes;
-  if(no_flow_control) return;
-  if(verbose) plog("FC: Flushing ISOTP buffers\n");
-  frame.can_id = id;
-  while(gBufLengthRemaining > 0) {
-    if(gBufLengthRemaining > 7) {
-      frame.len = 8;
-      frame.data[0] = gBufCounter;
-      memcpy(&frame.data[1], gBuffer+(gBufSize-gBufLengthRemaining), 7);
-      nbytes = write(can, &frame, CAN_MTU);
-      if(nbytes < 0) perror("Write packet (FC)");
-      gBufCounter++;
-      gBufLengthRemaining -= 7;
-    } else {
-      frame.len = gBufLengthRemaining + 1;
-      frame.data[0] = gBufCounter;
-      memcpy(&frame.data[1], gBuffer+(gBufSize-gBufLengthRemaining), CAN_MTU);
-      nbytes = write(can, &frame, CAN_MTU);
-      if(nbytes < 0) perror("Write packet (FC Final)");
-      gBufLengthRemaining = 0;
+// Saves the arguments for fmt.  Strings are copied since they are often
+// stack buffers that are gone by the time the record is written out.
+// Returns -1 if the format can't be saved this way
+int log_save_args(struct log_rec *rec, char *fmt, va_list args) {
+  char *p, *str;
+  int lng, n;
+  for(p = fmt; *p; p++) {
+    if(*p != '%') continue;
+    p++;
+    if(*p == '%') continue;
+    while(*p && strchr("-+ #0123456789.", *p)) p++;
+    for(lng = 0; *p == 'l'; p++) lng++;
+    if(rec->nargs == LOG_MAX_ARGS) return -1;
+    switch(*p) {
+      case 'd':
+      case 'i':
+        rec->args[rec->nargs++].i = lng > 1 ? va_arg(args, long long) : lng ? va_arg(args, long) : va_arg(args, int);
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'c':
+        rec->args[rec->nargs++].i = lng > 1 ? va_arg(args, unsigned long long) : lng ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+        break;
+      case 'p':
+        rec->args[rec->nargs++].i = (uintptr_t)va_arg(args, void *);
+        break;
+      case 'f':
+      case 'e':
+      case 'g':
+        rec->args[rec->nargs++].f = va_arg(args, double);
+        break;
+      case 's':
+        str = va_arg(args, char *);
+        if(!str) str = "(null)";
+        n = strlen(str);
+        if(n > LOG_DATA_MAX - 1 - rec->len) n = LOG_DATA_MAX - 1 - rec->len;
+        if(n < 0) n = 0;
+        memcpy(&rec->data[rec->len], str, n);
+        rec->data[rec->len + n] = 0;
+        rec->args[rec->nargs++].i = rec->len;
+        rec->len += n + 1;
+        if(rec->len > LOG_DATA_MAX - 1) rec->len = LOG_DATA_MAX - 1;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Turns a record back into text, on the logging thread
+int log_format(struct log_rec *rec, char *out, int size) {
+  char spec[16];
+  char *p, *start;
+  int len = 0, arg = 0, i, n;
+  if(log_timestamps) len += snprintf(out, size, "%llu.%06llu ",
+                                     (unsigned long long)(rec->ts - log_start_us) / 1000000,
+                                     (unsigned long long)(rec->ts - log_start_us) % 1000000);
+  switch(rec->type) {
+    case LOG_PKT:
+      len += snprintf(out + len, size - len, "Pkt: %02X#", rec->can_id);
+      // Fall through
+    case LOG_BIN:
+      for(i = 0; i < rec->len && len < size - 4; i++) len += snprintf(out + len, size - len, "%02X ", rec->data[i]);
+      len += snprintf(out + len, size - len, "\n");
+      return len < size ? len : size - 1;
+  }
+  for(p = rec->fmt; *p && len < size - 1; p++) {
+    if(*p != '%') {
+      out[len++] = *p;
+      continue;
+    }
+    start = p++;
+    if(*p == '%') {
+      out[len++] = '%';
+      continue;
+    }
+    while(*p && strchr("-+ #0123456789.l", *p)) p++;
+    if(!*p || p - start > 10 || arg >= rec->nargs) break;
+    // Copy the flags and width, the length modifier depends on how it was saved
+    for(n = 0; start < p; start++) if(*start != 'l') spec[n++] = *start;
+    if(strchr("diuxX", *p)) {
+      spec[n++] = 'l';
+      spec[n++] = 'l';
+    }
+    spec[n++] = *p;
+    spec[n] = 0;
+    switch(*p) {
+      case 'f':
+      case 'e':
+      case 'g':
+        n = snprintf(out + len, size - len, spec, rec->args[arg++].f);
+        break;
+      case 's':
+        n = snprintf(out + len, size - len, spec, (char *)&rec->data[rec->args[arg++].i]);
+        break;
+      case 'p':
+        n = snprintf(out + len, size - len, spec, (void *)(uintptr_t)rec->args[arg++].i);
+        break;
+      case 'c':
+        n = snprintf(out + len, size - len, spec, (int)rec->args[arg++].i);
+        break;
+      default:
+        n = snprintf(out + len, size - len, spec, rec->args[arg++].i);
+        break;
+    }
+    len += n;
+  }
+  if(len > size - 1) len = size - 1;
+  out[len] = 0;
+  return len;
+}
+
+void *log_thread_main(void *arg) {
+  char buf[LOG_LINE_MAX];
+  unsigned long head, tail;
+  int len;
+  while(1) {
+    head = atomic_load_explicit(&log_head, memory_order_acquire);
+    tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    if(head == tail) {
+      if(atomic_load(&log_stopping)) break;
+      fflush(plogfp ? plogfp : stdout);
+      pthread_mutex_lock(&log_lock);
+      while(atomic_load(&log_head) == tail && !atomic_load(&log_stopping)) pthread_cond_wait(&log_wake, &log_lock);
+      pthread_mutex_unlock(&log_lock);
+      continue;
+    }
+    for(; tail != head; tail++) {
+      len = log_format(&log_ring[tail & (LOG_RING_SLOTS - 1)], buf, sizeof(buf));
+      log_write(buf, len);
+      atomic_store(&log_tail, tail + 1); // Ordered against log_commit()'s check
     }
   }
+  fflush(plogfp ? plogfp : stdout);
+  return NULL;
 }
 
-void flow_control_push(int can) {
-  flow_control_push_to(can, 0x7e8);
+void log_stop() {
+  if(!log_async) return;
+  atomic_store(&log_stopping, 1);
+  pthread_mutex_lock(&log_lock);
+  pthread_cond_signal(&log_wake);
+  pthread_mutex_unlock(&log_lock);
+  pthread_join(log_thread, NULL);
+  log_async = 0;
 }
 
-void isotp_send_to(int can, char *data, int size, int dest) {
-  struct canfd_frame frame;
-  int left = size;
-  int counter;
-  int nbytes;
-  if(size > 256) return;
-  frame.can_id = dest;
-  if(size < 7) {
-    frame.len = size + 1;
-    frame.data[0] = size;
-    memcpy(&frame.data[1], data, size);
-    nbytes = write(can, &frame, CAN_MTU);
-    if(nbytes < 0) perror("Write packet");
-  } else {
-    frame.len = 8;
-    frame.data[0] = 0x10;
-    if(fuzz_level > 2 && keep_spec == 0) {
-      frame.data[1] = rand() % 256;
-      printf("Breaking ISOTP specs real size = %d reported size = %d\n", size, frame.data[1]);
-    } else {
-      frame.data[1] = (char)size-1;
-    }
-    memcpy(&frame.data[2], data, 6);
-    nbytes = write(can, &frame, CAN_MTU);
-    if(nbytes < 0) perror("Write packet");
-    left -= 6;
-    counter = 0x21;
-    if(no_flow_control) {
-      while(left > 0) {
-        if(left > 7) {
-          frame.len = 8;
-          frame.data[0] = counter;
-          memcpy(&frame.data[1], data+(size-left), 7);
-          write(can, &frame, CAN_MTU);
-          counter++;
-          left -= 7;
-        } else {
-          frame.len = left + 1;
-          frame.data[0] = counter;
-          memcpy(&frame.data[1], data+(size-left), CAN_MTU);
-          write(can, &frame, frame.len);
-          left = 0;
-        }
-      }
-    } else { // FC
-      memcpy(gBuffer, data, size); // Size is restricted to <256
-      gBufSize = size;
-      gBufLengthRemaining = left;
-      gBufCounter = counter;
+void log_start() {
+  log_ring = calloc(LOG_RING_SLOTS, sizeof(struct log_rec));
+  if(!log_ring) {
+    perror("log_start");
+    return;
+  }
+  log_start_us = now_us();
+  if(pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+    perror("pthread_create");
+    return;
+  }
+  log_async = 1;
+  atomic_thread_fence(memory_order_seq_cst);
+  atexit(log_stop);
+}
+
+// Simple function to print logging info to screen or to a file
+void plog(char *fmt, ...) {
+  struct log_rec *rec;
+  va_list args, copy;
+  char buf[LOG_LINE_MAX];
+  int len;
+
+  if(log_async) {
+    rec = log_reserve(LOG_TEXT);
+    if(!rec) return;
+    rec->fmt = fmt;
+    va_start(args, fmt);
+    va_copy(copy, args);
+    if(log_save_args(rec, fmt, args) < 0) { // Format it here instead
+      vsnprintf((char *)rec->data, LOG_DATA_MAX, fmt, copy);
+      rec->fmt = "%s";
+      rec->nargs = 1;
+      rec->args[0].i = 0;
     }
+    va_end(copy);
+    va_end(args);
+    log_commit();
+    return;
   }
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if(len > (int)sizeof(buf) - 1) len = sizeof(buf) - 1;
+  log_write(buf, len);
+}
+
+// Logs a frame or a buffer as hex without formatting it here.  Anything
+// longer than a record is split, one line per LOG_DATA_MAX bytes
+void log_bytes(int type, canid_t can_id, unsigned char *data, int len) {
+  struct log_rec rec_sync;
+  struct log_rec *rec;
+  char buf[LOG_LINE_MAX];
+  int n;
+  do {
+    rec = log_async ? log_reserve(type) : &rec_sync;
+    if(!rec) return;
+    n = len > LOG_DATA_MAX ? LOG_DATA_MAX : len;
+    rec->type = type;
+    rec->can_id = can_id;
+    rec->len = n;
+    memcpy(rec->data, data, n);
+    if(log_async) {
+      log_commit();
+    } else {
+      rec->ts = now_us();
+      log_write(buf, log_format(rec, buf, sizeof(buf)));
+    }
+    type = LOG_BIN; // The rest is a plain dump
+    data += n;
+    len -= n;
+  } while(len > 0);
+}
+
+void record_jitter(struct jitter_stats *js, uint64_t due, uint64_t now) {
+  uint64_t late = now > due ? now - due : 0;
+  js->count++;
+  js->total_us += late;
+  if(late > js->max_us) js->max_us = late;
 }
 
-void isotp_send(int can, char *data, int size) {
-  isotp_send_to(can, data, size, 0x7e8);
+void print_jitter(char *name, struct jitter_stats *js) {
+  if(!js->count) return;
+  plog("%s timer jitter: %lu events, avg %.1fus, max %luus\n", name, js->count,
+       (double)js->total_us / js->count, (unsigned long)js->max_us);
 }
 
 /*
- * Some UDS queries requiest periodic data.  This handles those
+ * Fuzz data.  Every fuzzed reply is a numbered case and the generator is
+ * reseeded from (seed, case) at the start of it, so any reply can be
+ * regenerated exactly with -s <seed>:<case>.  xoshiro256** seeded through
+ * splitmix64; nothing here allocates.
  */
-void handle_pending_data(int can) {
-  struct canfd_frame frame;
-  struct timeval tv;
-  long currcms;
-  int i, offset, datacnt;
-  if(!pending_data) return;
-
-  gettimeofday(&tv, NULL);
-  currcms = (tv.tv_sec - start_tv.tv_sec) * 100 + (tv.tv_usec / 10000);
-
-  if(IS_SET(pending_data, PENDING_READ_DATA_BY_ID_GM)) {
-        if(gm_data_by_id.data[0] == 0xFE) {
-          offset = 1;
-        } else {
-          offset = 0;
-        }
-        frame.can_id = gm_data_by_id.can_id;
-        frame.len = 8;
-        switch(gm_data_by_id.data[2 + offset]) { // Subfunctions
-          case 0x02:  // Slow Rate
-            if (currcms - gm_lastcms > 1000) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a slow rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          case 0x03:  // Medium Rate
-            if (currcms - gm_lastcms > 100) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a medium rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          case 0x04:  // Fast Rate
-            if (currcms - gm_lastcms > 20) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a fast rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          default:
-            plog("Unknown subfunction timer\n");
-            break;
-        }
-  } // IS_SET PENDING_READ_DATA_BY_ID_GM
+uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
 }
 
-void send_dtcs(int can, char total, struct canfd_frame frame) {
-  char resp[1024];
-  char i;
-  memset(resp, 0, 1024);
-  switch(fuzz_level) {
-    case 0:  // Default is to make P01XX where XX = total number of DTCs
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = total; // Total DTCs
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = 1;
-        resp[2+i+1] = i;
-      }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
-      }
+void rng_seed(struct fuzz_rng *r, uint64_t seed, uint64_t stream) {
+  uint64_t x = seed ^ (stream * 0xD1342543DE82EF95ULL);
+  int i;
+  for(i = 0; i < 4; i++) r->s[i] = splitmix64(&x);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(struct fuzz_rng *r) {
+  uint64_t *s = r->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+// Starts a new fuzz case.  what is only for the log
+void fuzz_begin(char *what) {
+  fuzz_case++;
+  rng_seed(&fuzz_rng, fuzz_seed, fuzz_case);
+  if(verbose) plog("Fuzz case %lu (seed %llu): %s\n", fuzz_case, (unsigned long long)fuzz_seed, what);
+}
+
+// Uniform in [0, n)
+uint32_t rng_range(struct fuzz_rng *r, uint32_t n) {
+  return ((rng_next(r) >> 32) * n) >> 32;
+}
+
+// Uniform in [0, n) from the current case
+uint32_t fuzz_rand(uint32_t n) {
+  return rng_range(&fuzz_rng, n);
+}
+
+// Fills buf with size random bytes from the given character set
+void gen_data(int scope, unsigned char *buf, int size) {
+  static const char alpha[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  static const char alphanum[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  uint64_t bits = 0;
+  int i;
+  switch(scope) {
+    case DATA_ALPHA:
+      for(i = 0; i < size; i++) buf[i] = alpha[fuzz_rand(sizeof(alpha) - 1)];
       break;
-    case 1:
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = rand() % 256;
-      if (verbose) plog("Randomized total DTCs to %d real DTCs %d\n", resp[1], total);
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = 1;
-        resp[2+i+1] = i;
-      }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
+    case DATA_ALPHANUM:
+      for(i = 0; i < size; i++) buf[i] = alphanum[fuzz_rand(sizeof(alphanum) - 1)];
+      break;
+    case DATA_BINARY:
+      for(i = 0; i < size; i++) {
+        if(!(i & 7)) bits = rng_next(&fuzz_rng);
+        buf[i] = bits;
+        bits >>= 8;
       }
       break;
-    case 2:
     default:
-      resp[0] = frame.data[1] + 0x40;
-      total = rand() % 128;
-      resp[1] = total;
-      if (verbose) plog("Randomized total DTCs to %d\n", resp[1]);
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = rand() % 256;
-        resp[2+i+1] = rand() % 256;
-      }
-      if (verbose) {
-        plog("DTC random data is:\n");
-        print_bin(&resp[2], total*2);
-      }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
-      }
+      memset(buf, 0, size);
       break;
   }
 }
 
-unsigned char calc_vin_checksum(char *vin, int size) {
-  char w[17] = { 8, 7, 6, 5, 4, 3, 2, 10, 0, 9, 8, 7, 6, 5, 4, 3, 2 };
+uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// For durations, immune to clock steps
+uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Fuzz campaigns (-C).  The ISO-TP reply to each request gets one mutation
+ * from the enabled strategies, taken in turn per (request ID, SID) so every
+ * request type sees all of them.  Each mutation is a fuzz case.  The tester
+ * is the oracle: if it goes quiet, stops sending TesterPresent or restarts
+ * its diagnostic session right after a case, the recent cases are written
+ * out with the seed and case numbers that replay them.
+ */
+char *fuzz_strategy_names[FUZZ_STRATEGIES] = { "length", "seq", "oversize", "undersize", "nrc", "dtc" };
+
+// Comma separated strategy names or "all".  Returns the mask, -1 for an unknown name
+int camp_parse(char *list) {
+  char buf[128], *name, *save;
+  int mask = 0;
   int i;
-  int checksum = 0;
-  int num;
-  for(i=0; i < size; i++) {
-    if(vin[i] == 'I' || vin[i] == 'O' || vin[i] == 'Q') {
-      num = 0;
-    } else {
-      if(vin[i] >= '0' && vin[i] <='9') num = vin[i] - '0';
-      if(vin[i] >= 'A' && vin[i] <='I') num = (vin[i] - 'A') + 1;
-      if(vin[i] >= 'J' && vin[i] <='R') num = (vin[i] - 'J') + 1;
-      if(vin[i] >= 'S' && vin[i] <='Z') num = (vin[i] - 'S') + 2;
+  strncpy(buf, list, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  for(name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    if(!strcmp(name, "all")) {
+      mask |= (1 << FUZZ_STRATEGIES) - 1;
+      continue;
     }
-    checksum += num * w[i];
+    for(i = 0; i < FUZZ_STRATEGIES; i++) {
+      if(!strcmp(name, fuzz_strategy_names[i])) break;
+    }
+    if(i == FUZZ_STRATEGIES) return -1;
+    mask |= 1 << i;
   }
-  checksum = checksum % 11;
-  if (checksum == 10) return 'X';
-  return ('0' + checksum);
+  return mask;
 }
 
-void send_error_snfs(int can, struct canfd_frame frame) {
-  char resp[4];
-  if(verbose) plog("Responded with Sub Function Not Supported\n");
-  resp[0] = 0x7f;
-  resp[1] = frame.data[1];
-  resp[2] = 12; // SubFunctionNotSupported
-  isotp_send(can, resp, 3);
+struct camp_entry *camp_lookup(canid_t can_id, int sid) {
+  unsigned int slot = ((can_id * 31) ^ sid) & (CAMP_TABLE_SIZE - 1);
+  int i;
+  for(i = 0; i < CAMP_TABLE_SIZE; i++, slot = (slot + 1) & (CAMP_TABLE_SIZE - 1)) {
+    if(!camp_table[slot]) break;
+    if(camp_table[slot]->can_id == can_id && camp_table[slot]->sid == sid) return camp_table[slot];
+  }
+  if(i == CAMP_TABLE_SIZE) return NULL;
+  camp_table[slot] = calloc(1, sizeof(struct camp_entry));
+  if(!camp_table[slot]) return NULL;
+  camp_table[slot]->can_id = can_id;
+  camp_table[slot]->sid = sid;
+  return camp_table[slot];
 }
 
-void send_error_roor(int can, struct canfd_frame frame, int id) {
-  char resp[4];
-  if(verbose) plog("Responded with Sub Function Not Supported\n");
-  resp[0] = 0x7f;
-  resp[1] = frame.data[1];
-  resp[2] = 31; // RequestOutOfRange
-  isotp_send_to(can, resp, 3, id);
+struct camp_case *camp_last_case() {
+  if(!camp_cases) return NULL;
+  return &camp_history[(camp_cases - 1) % CAMP_HISTORY];
 }
 
-void generic_OK_resp(int can, struct canfd_frame frame) {
-  char resp[4];
-  if(verbose > 1) plog("Responding with a generic OK message\n");
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = frame.data[2];
-  resp[2] = 0;
-  isotp_send(can, resp, 3);
+void camp_print_bytes(FILE *fp, char *what, canid_t can_id, unsigned char *data, int len) {
+  int i;
+  fprintf(fp, "%s %03X#", what, can_id);
+  for(i = 0; i < len && i < CAMP_SAVE_BYTES; i++) fprintf(fp, "%02X", data[i]);
+  if(len > CAMP_SAVE_BYTES) fprintf(fp, "...");
+  fprintf(fp, " (%d bytes)\n", len);
 }
 
-void generic_OK_resp_to(int can, struct canfd_frame frame, int id) {
-  char resp[4];
-  if(verbose > 1) plog("Responding with a generic OK message\n");
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = frame.data[2];
-  resp[2] = 0;
-  isotp_send_to(can, resp, 3, id);
+// Blames the last case for reason and writes out the recent ones
+void camp_finding(char *reason) {
+  static unsigned long saved_case = 0;
+  struct camp_case *c = camp_last_case();
+  char path[512];
+  FILE *fp;
+  uint64_t now = now_us();
+  int i;
+  if(!c) return;
+  plog("Campaign: %s after case %lu (%s on %03X %02X)\n", reason, c->fuzz_case,
+       fuzz_strategy_names[c->strategy], c->req_id, c->entry->sid);
+  if(c->fuzz_case == saved_case) return; // Same case, already counted and saved
+  saved_case = c->fuzz_case;
+  camp_findings++;
+  c->entry->findings[c->strategy]++;
+  snprintf(path, sizeof(path), "%s/uds-fuzz-%llu-%lu.txt", camp_dir, (unsigned long long)fuzz_seed, c->fuzz_case);
+  fp = fopen(path, "w");
+  if(!fp) {
+    perror(path);
+    return;
+  }
+  fprintf(fp, "# %s\n", reason);
+  fprintf(fp, "# Replay with: uds-server -C %s -s %llu:%lu", fuzz_strategy_names[c->strategy],
+          (unsigned long long)fuzz_seed, c->fuzz_case);
+  if(fuzz_level) fprintf(fp, " -%.*s", fuzz_level > 8 ? 8 : fuzz_level, "zzzzzzzz");
+  fprintf(fp, "%s <can_interface>\n", keep_spec ? " -c" : "");
+  fprintf(fp, "# then send the request below.  Most recent case first\n");
+  for(i = 0; i < CAMP_HISTORY && i < camp_cases; i++) {
+    c = &camp_history[(camp_cases - 1 - i) % CAMP_HISTORY];
+    fprintf(fp, "\ncase %lu %s, %.3fs before\n", c->fuzz_case, fuzz_strategy_names[c->strategy],
+            (now - c->sent_us) / 1000000.0);
+    camp_print_bytes(fp, "request", c->req_id, c->req, c->req_len);
+    camp_print_bytes(fp, "reply", c->resp_id, c->resp, c->resp_len);
+  }
+  fclose(fp);
+  plog("Campaign: saved %s\n", path);
 }
 
-void handle_current_data(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received Current info request\n");
-  char resp[8];
-  switch(frame.data[2]) {
-    case 0x00: // Supported PIDs
-      if(verbose) plog("Responding with a generic set of PIDs (1-20)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x01: // MIL & DTC Status
-      if(verbose) plog("Responding to MIL and DTC Status request\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0x00;
-      resp[3] = 0x07;
-      resp[4] = 0xE5;
-      resp[5] = 0xE5;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x20: // More supported PIDs (21-40)
-      if(verbose) plog("Responding with PIDs supported (21-40)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
+// Any frame from a tester
+void camp_activity() {
+  struct camp_case *c = camp_last_case();
+  uint64_t now = now_us();
+  if(c && c->sent_us >= camp_last_rx) { // First frame since the last case
+    camp_wait_us += now - c->sent_us;
+    camp_waits++;
+  }
+  if(camp_silent) plog("Campaign: tester is back after %.1fs\n", (now - camp_last_rx) / 1000000.0);
+  camp_silent = 0;
+  camp_last_rx = now;
+}
+
+// Called from dispatch_msg() for every request
+void camp_request(struct uds_msg *msg) {
+  struct camp_case *c = camp_last_case();
+  uint64_t now = now_us();
+  int len;
+  if(msg->data[1] == UDS_SID_TESTER_PRESENT) {
+    if(camp_last_tp && now - camp_last_tp < CAMP_SILENCE_MS * 1000) {
+      camp_tp_gap = camp_tp_gap ? (camp_tp_gap * 3 + now - camp_last_tp) / 4 : now - camp_last_tp;
+    }
+    if(camp_tp_lost) plog("Campaign: TesterPresent is back\n");
+    camp_last_tp = now;
+    camp_tp_lost = 0;
+  }
+  if(msg->data[1] == UDS_SID_DIAGNOSTIC_CONTROL && camp_sessions++ && c && now - c->sent_us < CAMP_RESET_MS * 1000)
+    camp_finding("tester restarted its diagnostic session");
+  camp_begin_ns = mono_ns();
+  camp_cur.entry = camp_lookup(msg->can_id, msg->data[1]);
+  if(!camp_cur.entry) return;
+  len = msg_payload_len(msg);
+  camp_cur.fuzz_case = fuzz_case + 1;
+  camp_cur.req_id = msg->can_id;
+  camp_cur.req_len = len;
+  memcpy(camp_cur.req, &msg->data[1], len < CAMP_SAVE_BYTES ? len : CAMP_SAVE_BYTES);
+  camp_cur_open = 1;
+}
+
+void camp_request_done() {
+  camp_busy_ns += mono_ns() - camp_begin_ns;
+  camp_cur_open = 0;
+}
+
+// Response codes ISO 14229-1 defines.  Everything else is reserved
+int camp_nrc_defined(int nrc) {
+  if(nrc >= 0x10 && nrc <= 0x14) return 1;
+  if(nrc >= 0x21 && nrc <= 0x26 && nrc != 0x23) return 1;
+  if(nrc >= 0x31 && nrc <= 0x37 && nrc != 0x32) return 1;
+  if(nrc >= 0x70 && nrc <= 0x73) return 1;
+  if(nrc == 0x78 || nrc == 0x7E || nrc == 0x7F) return 1;
+  if(nrc >= 0x81 && nrc <= 0x93) return 1;
+  return nrc >= 0xF0 && nrc <= 0xFE; // Manufacturer specific
+}
+
+/*
+ * Picks the next strategy for the request being handled and applies it if
+ * it changes the payload.  The ISO-TP header strategies are applied by
+ * isotp_send_to() as the frames are built.  Returns the strategy or -1.
+ */
+int camp_mutate(unsigned char **data, int *size, int dest) {
+  struct camp_entry *e = camp_cur.entry;
+  struct camp_case *c;
+  unsigned char *p = *data;
+  int n = *size;
+  int i, s, limit;
+  if(!camp_cur_open) return -1;
+  camp_cur_open = 0; // One case per request
+  for(i = 0; i < FUZZ_STRATEGIES; i++) {
+    s = (e->next + i) % FUZZ_STRATEGIES;
+    if(!(camp_mask & (1 << s))) continue;
+    if(s == FUZZ_SEQ && (n <= 7 || n <= isotp_tx_dl() - 2)) continue; // Needs a multi-frame reply
+    if(s == FUZZ_OVERSIZE && n >= sizeof(camp_buf)) continue;
+    if(s == FUZZ_UNDERSIZE && n < 2) continue;
+    if(s == FUZZ_DTC_COUNT && (n < 2 || (p[0] != 0x43 && p[0] != 0x47 && p[0] != 0x4A))) continue;
+    break;
+  }
+  if(i == FUZZ_STRATEGIES) return -1;
+  e->next = s + 1;
+  e->runs[s]++;
+  fuzz_begin(fuzz_strategy_names[s]);
+  switch(s) {
+    case FUZZ_OVERSIZE:
+      limit = n * 4 + 64;
+      if(limit > sizeof(camp_buf) - n) limit = sizeof(camp_buf) - n;
+      memcpy(camp_buf, p, n);
+      i = 1 + fuzz_rand(limit);
+      gen_data(DATA_BINARY, &camp_buf[n], i);
+      n += i;
+      p = camp_buf;
       break;
-    case 0x40: // More supported PIDs (41-60)
-      if(verbose) plog("Responding with PIDs supported (41-60)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
+    case FUZZ_UNDERSIZE:
+      n = 1 + fuzz_rand(n - 1);
       break;
-    case 0x41: // Monitor status this drive cycle
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0;
-      resp[3] = 0x0F;
-      resp[4] = 0xFF;
-      resp[5] = 0x00;
-      isotp_send(can, resp, 6);
+    case FUZZ_NRC:
+      camp_buf[0] = 0x7F;
+      camp_buf[1] = camp_cur.req[0];
+      do camp_buf[2] = fuzz_rand(256); while(camp_nrc_defined(camp_buf[2]));
+      nrc_sent[camp_buf[2]]++;
+      n = 3;
+      p = camp_buf;
       break;
-    case 0x60: // More supported PIDs (61-80)
-      if(verbose) plog("Responding with PIDs supported (61-80)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x80: // More supported PIDs (81-100)
-      if(verbose) plog("Responding with PIDs supported (81-100)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0xA0:  // More Supported PIDs (101-120)
-      if(verbose) plog("Responding with PIDs supported (101-120)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0xC0: // More supported PIDs (121-140)
-      if(verbose) plog("Responding with PIDs supported (121-140)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    default:
-      if(verbose) plog("Note: Requested unsupported service %02X\n", frame.data[2]);
+    case FUZZ_DTC_COUNT:
+      memcpy(camp_buf, p, n);
+      do camp_buf[1] = fuzz_rand(256); while(camp_buf[1] == p[1]);
+      p = camp_buf;
       break;
   }
+  c = &camp_history[camp_cases++ % CAMP_HISTORY];
+  *c = camp_cur;
+  c->strategy = s;
+  c->resp_id = dest;
+  c->resp_len = n;
+  memcpy(c->resp, p, n < CAMP_SAVE_BYTES ? n : CAMP_SAVE_BYTES);
+  c->sent_us = now_us();
+  if(!camp_start_us) camp_start_us = c->sent_us;
+  *data = p;
+  *size = n;
+  return s;
 }
 
-void handle_vehicle_info(int can, struct canfd_frame frame) {
-  char *buf;
-  int pktsize = 0;
-  unsigned char chksum;
-  if(verbose) plog("Received Vehicle info request\n");
-  char resp[300];
-  switch(frame.data[2]) {
-    case 0x00: // Supported PIDs
-      if(verbose) plog("Replying with ALL Pids supported\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0x55;
-      resp[3] = 0;
-      resp[4] = 0;
-      resp[5] = 0;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x02: // Get VIN
-      switch(fuzz_level) {
-        case 0:
-          if(verbose) plog("Sending VIN %s\n", vin);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          memcpy(&resp[3], vin, strlen(vin));
-          isotp_send(can, resp, 4 + strlen(vin));
-          break;
-        case 1:
-          if(verbose) plog("Fuzzing VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_ALPHANUM, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) plog("Using VIN: %s\n", buf);
-          memcpy(&resp[3], buf, 17);
-          free(buf);
-          isotp_send(can, resp, 4 + 17);
-          break;
-        case 2:
-        case 3:  // At 3 the ISOTP spec gets flaky
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing big VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_ALPHANUM, pktsize);
-          chksum = calc_vin_checksum(buf, pktsize);
-          buf[8] = chksum;
-          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
-          memcpy(&resp[3], buf, pktsize);
-          free(buf);
-          isotp_send(can, resp, 4 + pktsize);
-          break;
-        case 4:
-          if(verbose) plog("Fuzzing VIN with binary data\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_BINARY, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) print_bin(buf, 17);
-          memcpy(&resp[3], buf, 17);
-          free(buf);
-          isotp_send(can, resp, 4 + 17);
-          break;
-        case 5:
-        default:
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_BINARY, pktsize);
-          if(verbose) print_bin(buf, pktsize);
-          memcpy(&resp[3], buf, pktsize);
-          free(buf);
-          isotp_send(can, resp, 4 + pktsize);
-          break;
-      }
-      break;
-    default:
-      break;
+// Rewrites the length in the PCI of a single or first frame
+void camp_lie_len(struct canfd_frame *frame, int size) {
+  int dl;
+  if((frame->data[0] & 0xF0) == ISOTP_FIRST_FRAME) {
+    do dl = fuzz_rand(ISOTP_FF_DL_MAX + 1); while(dl == size);
+    frame->data[0] = ISOTP_FIRST_FRAME | (dl >> 8);
+    frame->data[1] = dl & 0xFF;
+  } else if(size > 7) { // CAN FD single frame
+    do dl = fuzz_rand(256); while(dl == size);
+    frame->data[1] = dl;
+  } else {
+    do dl = fuzz_rand(16); while(dl == size);
+    frame->data[0] = dl;
   }
+  if(verbose) plog("Campaign: reply of %d bytes sent with length %d\n", size, dl);
 }
 
-void handle_pending_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for pending trouble codes\n");
-  send_dtcs(can, 20, frame);
+// One of the consecutive frames still to go jumps ahead in sequence
+void camp_bad_seq(struct isotp_tx *tx) {
+  int cfs = (tx->size - tx->offset + isotp_tx_dl() - 2) / (isotp_tx_dl() - 1);
+  tx->seq_fault = 1 + fuzz_rand(cfs);
+  tx->seq_jump = 1 + fuzz_rand(15);
+  if(verbose) plog("Campaign: consecutive frame %d of %d skips %d\n", tx->seq_fault, cfs, tx->seq_jump);
 }
 
-void handle_stored_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for stored trouble codes\n");
-  send_dtcs(can, 2, frame);
+// Earliest time the oracle needs to check on the tester, 0 if never
+uint64_t camp_next_deadline() {
+  uint64_t deadline = 0;
+  uint64_t tp_due = camp_last_tp + CAMP_TP_MISSES * camp_tp_gap;
+  if(!camp_cases) return 0;
+  if(!camp_silent && camp_last_rx) deadline = camp_last_rx + CAMP_SILENCE_MS * 1000;
+  if(!camp_tp_lost && camp_tp_gap && (!deadline || tp_due < deadline)) deadline = tp_due;
+  return deadline;
 }
 
-// TODO: This is wrong.  Record a real transaction to see the format
-void handle_freeze_frame(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for freeze frame code\n");
-  //send_dtcs(can, 1, frame);
-  char resp[4];
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = 0x01;
-  resp[2] = 0x01;
-  isotp_send(can, resp, 3);
+// Looks for a tester that stopped talking to us
+void camp_poll() {
+  uint64_t now;
+  if(!camp_cases) return;
+  now = now_us();
+  if(!camp_tp_lost && camp_tp_gap && now >= camp_last_tp + CAMP_TP_MISSES * camp_tp_gap) {
+    camp_tp_lost = 1;
+    camp_finding("tester stopped sending TesterPresent");
+  }
+  if(!camp_silent && camp_last_rx && now >= camp_last_rx + CAMP_SILENCE_MS * 1000) {
+    camp_silent = 1;
+    camp_finding("tester went silent");
+  }
 }
 
-void handle_perm_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for permanent trouble codes\n");
-  send_dtcs(can, 0, frame);
+double camp_elapsed() {
+  return camp_start_us ? (now_us() - camp_start_us) / 1000000.0 : 0;
 }
 
-void handle_dsc(int can, struct canfd_frame frame) {
-  //if(verbose) plog("Received DSC Request\n");
-  //send_error_snfs(can, frame);
-  if(verbose) plog("Received DSC Request giving VCDS respose\n");
-      frame.can_id = 0x77A;
-      frame.len = 8;
-      frame.data[0] = 0x06;
-      frame.data[1] = 0x50;
-      frame.data[2] = 0x03;
-      frame.data[3] = 0x00;
-      frame.data[4] = 0x32;
-      frame.data[5] = 0x01;
-      frame.data[6] = 0xF4;
-      frame.data[7] = 0xAA;
-      write(can, &frame, CAN_MTU);
+// Where the campaign's time goes.  Few cases/s while we are mostly waiting
+// on the tester means the tool is the bottleneck, not us
+void camp_dump() {
+  struct camp_entry *e;
+  double secs = camp_elapsed();
+  char line[256];
+  int i, j, n;
+  if(!camp_cases || secs <= 0) return;
+  plog("Campaign: %lu cases in %.1fs (%.1f cases/s), %lu findings\n", camp_cases, secs, camp_cases / secs, camp_findings);
+  plog("Campaign: %.1f%% of the time handling requests, %.1f%% waiting on the tester (avg %.1fms)\n",
+       camp_busy_ns / 10000000.0 / secs, camp_wait_us / 10000.0 / secs,
+       camp_waits ? camp_wait_us / 1000.0 / camp_waits : 0);
+  for(i = 0; i < CAMP_TABLE_SIZE; i++) {
+    e = camp_table[i];
+    if(!e) continue;
+    for(j = 0, n = 0; j < FUZZ_STRATEGIES; j++) {
+      if(!e->runs[j]) continue;
+      n += snprintf(line + n, sizeof(line) - n, " %s=%lu", fuzz_strategy_names[j], e->runs[j]);
+      if(e->findings[j]) n += snprintf(line + n, sizeof(line) - n, "(%lu found)", e->findings[j]);
+    }
+    if(n) plog("   %03X %02X %-28s%s\n", e->can_id, e->sid, sid_name(e->sid), line);
+  }
 }
 
 /*
-  ECU Memory, based on VCDS response for now
-*/
-void handle_read_data_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Recieved Read Data by ID %02X %02X\n", frame.data[2], frame.data[3]);
-  char resp[120];
-  if(frame.data[2] == 0xF1) {
-    switch(frame.data[3]) {
-     case 0x87:
-       if(verbose) plog("Read data by ID 0x87\n");
-       resp[0] = frame.data[1] + 0x40;
-       resp[1] = frame.data[2];
-       resp[2] = 0x87;
-       resp[3] = 0x30;
-       resp[4] = 0x34;
-       resp[5] = 0x45;
-       resp[6] = 0x39;
-       resp[7] = 0x30;
-       resp[8] = 0x36;
-       resp[9] = 0x33;
-       resp[10] = 0x32;
-       resp[11] = 0x33;
-       resp[12] = 0x46;
-       resp[13] = 0x20; // Note VCDS pads with 55's
-       isotp_send_to(can, resp, 14, 0x77A);
-       break;
-      case 0x89:
-          if(verbose) plog("Read data by ID 0x89\n");
-          frame.can_id = 0x7E8;
-          frame.len = 8;
-          frame.data[0] = 0x07;
-          frame.data[1] = 0x62;
-          frame.data[2] = 0xF1;
-          frame.data[3] = 0x89;
-          frame.data[4] = 0x38; //8
-          frame.data[5] = 0x34; //4
-          frame.data[6] = 0x31; //1
-          frame.data[7] = 0x30; //0
-          write(can, &frame, CAN_MTU);
-        break;
-      case 0x9E:
-        if(verbose) plog("Read data by ID 0x9E\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0x45; 
-        resp[3] = 0x56;
-        resp[4] = 0x5F;
-        resp[5] = 0x47;
-        resp[6] = 0x61;
-        resp[7] = 0x74;
-        resp[8] = 0x65;
-        resp[9] = 0x77;
-        resp[10] = 0x45;
-        resp[11] = 0x56;
-        resp[12] = 0x43;
-        resp[13] = 0x6F;
-        resp[14] = 0x6E;
-        resp[15] = 0x74;
-        resp[16] = 0x69;
-        resp[17] = 0x00;
-        isotp_send(can, resp, 0x13);
-        break;
-      case 0xA2: 
-        if(verbose) plog("Read data by ID 0xA2\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0xA2;
-        resp[3] = 0x30; // 004010
-        resp[4] = 0x30;
-        resp[5] = 0x34;
-        resp[6] = 0x30;
-        resp[7] = 0x31;
-        resp[8] = 0x30;
-        isotp_send(can, resp, 9);
-        break;
-     default:
-        if(verbose) plog("Not responding to ID %02X\n", frame.data[3]);
-        break;
-     }
-  } else if(frame.data[2] == 0x06) {
-    switch(frame.data[3]) {
-     case 0x00:
-        if(verbose) plog("Read data by ID 0x9E\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0x02; 
-        resp[3] = 0x01;
-        resp[4] = 0x00;
-        resp[5] = 0x17;
-        resp[6] = 0x26;
-        resp[7] = 0xF2;
-        resp[8] = 0x00;
-        resp[9] = 0x00;
-        resp[10] = 0x5B;
-        resp[11] = 0x00;
-        resp[12] = 0x12;
-        resp[13] = 0x08;
-        resp[14] = 0x58;
-        resp[15] = 0x00;
-        resp[16] = 0x00;
-        resp[17] = 0x00;
-        resp[18] = 0x00;
-        resp[19] = 0x01;
-        resp[20] = 0x01;
-        resp[21] = 0x01;
-        resp[22] = 0x00;
-        resp[23] = 0x01;
-        resp[24] = 0x00;
-        resp[25] = 0x00;
-        resp[26] = 0x00;
-        resp[27] = 0x00;
-        resp[28] = 0x00;
-        resp[29] = 0x00;
-        resp[30] = 0x00;
-        resp[31] = 0x00;
-        isotp_send(can, resp, 0x21);
-       break;
-     case 0x01:
-          if(verbose) plog("Read data by ID 0x01\n");
-          send_error_roor(can, frame, 0x7E8);
-       break;
-     default:
-       if(verbose) plog("Not responding to ID %02X\n", frame.data[3]);
-       break;
-     }
-  } else {
-    if(verbose) plog("Unknown read data by ID %02X\n", frame.data[2]);
+ * Capture.  Every frame we receive or send is appended to a buffer as a
+ * small binary record and the buffer is written out when it fills up.
+ * RX frames carry the kernel receive timestamp, TX frames are stamped when
+ * they are handed to the kernel.  Use -x/-X to turn a capture into a
+ * candump log or a pcap file.
+ */
+void cap_flush() {
+  int off = 0, ret;
+  while(off < cap_len) {
+    ret = write(cap_fd, cap_buf + off, cap_len - off);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      perror("capture");
+      break;
+    }
+    off += ret;
   }
+  cap_len = 0;
 }
 
-/*
- GM
-*/
+void cap_frame(struct canfd_frame *frame, uint64_t ts_ns, int dir) {
+  struct cap_rec rec;
+  if(cap_len + sizeof(rec) + CANFD_MAX_DLEN > CAP_BUF_SIZE) cap_flush();
+  rec.ts_ns = ts_ns;
+  rec.can_id = frame->can_id;
+  rec.len = frame->len;
+  rec.flags = frame->flags;
+  rec.dir = dir;
+  rec.pad = 0;
+  memcpy(cap_buf + cap_len, &rec, sizeof(rec));
+  memcpy(cap_buf + cap_len + sizeof(rec), frame->data, frame->len);
+  cap_len += sizeof(rec) + frame->len;
+  cap_frames++;
+}
 
-// Read DID from ID (GM)
-// For now we are only setting this up to work with the BCM
-// 244   [3]  02 1A 90
-void handle_gm_read_did_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read DID by ID Request\n");
-  char resp[300];
-  char *buf;
-  char *tracenum = "874602RA51950204";
-  unsigned char chksum;
-  int pktsize;
-  switch(frame.data[2]) {
-    case 0x90:  // VIN
-      if(verbose) plog(" + Requested VIN\n");
-      switch(fuzz_level) {
-        case 0:
-          if(verbose) plog("Sending VIN %s\n", vin);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          memcpy(&resp[2], vin, strlen(vin));
-          isotp_send_to(can, resp, 3 + strlen(vin), 0x644);
-          break;
-        case 1:
-          if(verbose) plog("Fuzzing VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_ALPHANUM, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) plog("Using VIN: %s\n", buf);
-          memcpy(&resp[2], buf, 17);
-          free(buf);
-          isotp_send_to(can, resp, 3 + 17, 0x644);
-          break;
-        case 2:
-        case 3:  // At 3 the ISOTP spec gets flaky
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing big VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_ALPHANUM, pktsize);
-          chksum = calc_vin_checksum(buf, pktsize);
-          buf[8] = chksum;
-          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
-          memcpy(&resp[2], buf, pktsize);
-          free(buf);
-          isotp_send_to(can, resp, 3 + pktsize, 0x644);
-          break;
-        case 4:
-          if(verbose) plog("Fuzzing VIN with binary data\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_BINARY, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) print_bin(buf, 17);
-          memcpy(&resp[2], buf, 17);
-          free(buf);
-          isotp_send_to(can, resp, 3 + 17, 0x644);
-          break;
-        case 5:
-        default:
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_BINARY, pktsize);
-          if(verbose) print_bin(buf, pktsize);
-          memcpy(&resp[2], buf, pktsize);
-          free(buf);
-          isotp_send_to(can, resp, 3 + pktsize, 0x644);
-          break;
-       }
-      break;
-    case 0xA1:  // SDM Primary Key
-      if(verbose) plog(" + Requested SDM Primary Key\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending SDM Key %04X\n", 0x6966);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x69;
-          resp[3] = 0x66;
-          isotp_send_to(can, resp, 5, 0x644);
-          break;
-      }
-      break;
-    case 0xB4:  // Traceability Number
-      if(verbose) plog(" + Requested Traceability Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending Traceabiliity number %s\n", tracenum);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          memcpy(&resp[2], tracenum, strlen(tracenum));
-          isotp_send_to(can, resp, 3 + strlen(tracenum), 0x644);
-          break;
-      }
-      break;
-    case 0xB7:  // Software Number
-      if(verbose) plog(" + Requested Software Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending SW # %d\n", 600);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x42;
-          resp[3] = 0xAA;
-          resp[4] = 6;
-          resp[5] = 2; // 600
-          resp[6] = 0x58;
-          isotp_send_to(can, resp, 6, 0x644);
-          break;
-      }
-      break;
-    case 0xCB:  // End Model Part #
-      if(verbose) plog(" + Requested End Model Part Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending End Model Part Number %d\n", 15804602);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x00;
-          resp[3] = 0xF1;
-          resp[4] = 0x28;
-          resp[5] = 0xBA;
-          isotp_send_to(can, resp, 6, 0x644);
-          break;
-      }
-      break;
-    default:
-      break;
+int cap_open(char *file, char *ifname) {
+  struct cap_header hdr;
+  cap_buf = malloc(CAP_BUF_SIZE);
+  cap_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(!cap_buf || cap_fd < 0) {
+    perror(file);
+    return -1;
   }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CAP_MAGIC, sizeof(hdr.magic));
+  strncpy(hdr.ifname, ifname, sizeof(hdr.ifname) - 1);
+  memcpy(cap_buf, &hdr, sizeof(hdr));
+  cap_len = sizeof(hdr);
+  return 0;
 }
 
-/* GM Read Data via PID */
-/* 244   [5]  04 AA 03 02 07 */
-/* 544#0738408D8B000200 */
-/* 544#02508D8D00000000 */
-void handle_gm_read_data_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read Data by ID Request\n");
-  int offset = 0;
-  int i;
-  int datacnt;
-  char datacpy[8];
-  if (frame.data[0] == 0xFE) offset = 1;
-  memcpy(&datacpy, &frame.data, 8);
-  if(frame.can_id == 0x7e0) {
-    frame.can_id = 0x5e8;
-  } else {
-    frame.can_id = 0x500 + (frame.can_id & 0xFF);
+void cap_close() {
+  if(cap_fd < 0) return;
+  cap_flush();
+  close(cap_fd);
+  cap_fd = -1;
+}
+
+// Calls back for every record in a capture file.  Returns -1 on a bad file
+int cap_read(char *file, void (*cb)(struct cap_header *, struct cap_rec *, unsigned char *)) {
+  struct cap_header hdr;
+  struct cap_rec rec;
+  unsigned char data[CANFD_MAX_DLEN];
+  FILE *fp = fopen(file, "r");
+  if(!fp) {
+    perror(file);
+    return -1;
   }
-  frame.len = 8;
-  switch(frame.data[2 + offset]) { // Subfunctions
-    case 0x00:  // Stop
-      if(verbose) plog(" + Stop Data Request\n");
-      memset(frame.data, 0, 8);
-      write(can, &frame, CAN_MTU);
-      CLEAR_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      break;
-    case 0x01:  // One Response
-      if(verbose) plog(" + One Response\n");
-      for(i=3; i < datacpy[0]+1; i++) {
-        frame.data[0] = datacpy[i];
-        for(datacnt=1; datacnt < 8; datacnt++) {
-          frame.data[datacnt] = rand() % 256;
-        }
-        write(can, &frame, CAN_MTU);
-        sleep(0.5);
-      }
-      break;
-    case 0x02:  // Slow Rate
-      if(verbose) plog(" + Slow Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    case 0x03:  // Medium Rate
-      if(verbose) plog(" + Medium Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    case 0x04:  // Fast Rate
-      if(verbose) plog(" + Fast Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    default:
-      plog("Unknown subfunction timer\n");
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, CAP_MAGIC, sizeof(hdr.magic))) {
+    fprintf(stderr, "%s: Not a uds-server capture\n", file);
+    fclose(fp);
+    return -1;
+  }
+  while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if(rec.len > CANFD_MAX_DLEN || fread(data, 1, rec.len, fp) != rec.len) {
+      fprintf(stderr, "%s: Truncated capture\n", file);
       break;
+    }
+    cb(&hdr, &rec, data);
   }
+  fclose(fp);
+  return 0;
 }
 
-/* GM Diag format is either
-     101#FE 03 A9 81 52  (Functional addressing: Where FE is the extended address)
-     7E0#03 A9 81 52 (no extended addressing)
-*/
-void handle_gm_read_diag(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read Diagnostic Request\n");
-  int offset = 0;
-  int i, total;
-  char resp[150];
-  if(frame.data[0] == 0xFE) offset = 1;
-  switch(frame.data[2 + offset]) { // Subfunctions
-    case UDS_READ_STATUS_BY_MASK:  // Read DTCs by mask
-      if(verbose) {
-        plog(" + Read DTCs by mask\n");
-        if(frame.data[3 + offset] & DTC_SUPPORTED_BY_CALIBRATION) plog("   - Supported By Calibration\n");
-        if(frame.data[3 + offset] & DTC_CURRENT_DTC) plog("   - Current DTC\n");
-        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_CLEARED) plog("   - Tests not passed since DTC cleared\n");
-        if(frame.data[3 + offset] & DTC_TEST_FAILED_SINCE_CLEARED) plog("   - Tests failed since DTC cleared\n");
-        if(frame.data[3 + offset] & DTC_HISTORY) plog("   - DTC History\n");
-        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_POWER) plog("   - Tests not passed since power up\n");
-        if(frame.data[3 + offset] & DTC_CURRENT_DTC_SINCE_POWER) plog("   - Tests failed since power up\n");
-        if(frame.data[3 + offset] & DTC_WARNING_INDICATOR_STATE) plog("   - Warning Indicator State\n");
-      }
-      if(frame.can_id == 0x7e0) {
-        frame.can_id = 0x5e8;
-      } else {
-        frame.can_id = 0x500 + (frame.can_id & 0xFF);
-      }
-      frame.len = 8;
-      frame.data[0] = frame.data[2 + offset];
-      frame.data[1] = 0;    // DTC 1st byte
-      frame.data[2] = 0x30; // DTC 2nd byte
-      frame.data[3] = 0;
-      frame.data[4] = 0x6F; // Last Test/ This Ignition/ Last Clear bitflag
-      frame.data[5] = 0;
-      frame.data[6] = 0;
-      frame.data[7] = 0;
-      write(can, &frame, CAN_MTU);
-      sleep(0.2); // Instead of actually processing the FC
-      if(fuzz_level == 1) {
-        total = rand() % 1024;
-        if(verbose) plog("Sending %d DTCs\n", total);
-        for(i = 0; i < total; i++) {
-          frame.data[1] = rand() % 256;
-          frame.data[2] = (rand() % 255) + 1;
-          frame.data[3] = 0;
-          frame.data[4] = 0x6F; // Last DTC
-          write(can, &frame, CAN_MTU);
-          sleep(1);
-        }
-      }
-      frame.data[1] = 0; // Last frame must be a 0 DTC
-      frame.data[2] = 0;
-      frame.data[3] = 0;
-      frame.data[4] = 0xFF; // Last DTC
-      write(can, &frame, CAN_MTU);
-      break;
-    default:
-      if(verbose) plog(" + Unknown subfunction request %02X\n", frame.data[2 + offset]);
-      break;
+// candump -l format, with the R/T direction that candump -x adds
+void cap_print_candump(struct cap_header *hdr, struct cap_rec *rec, unsigned char *data) {
+  int i;
+  printf("(%010llu.%06llu) %s ", (unsigned long long)(rec->ts_ns / 1000000000),
+         (unsigned long long)(rec->ts_ns % 1000000000) / 1000, hdr->ifname);
+  if(rec->can_id & CAN_EFF_FLAG) {
+    printf("%08X#", rec->can_id & CAN_EFF_MASK);
+  } else {
+    printf("%03X#", rec->can_id & CAN_SFF_MASK);
   }
+  if(rec->flags & CANFD_FDF) printf("#%X", rec->flags & (CANFD_BRS | CANFD_ESI));
+  if(rec->can_id & CAN_RTR_FLAG) printf("R");
+  for(i = 0; i < rec->len; i++) printf("%02X", data[i]);
+  printf(" %s\n", rec->dir == CAP_TX ? "T" : "R");
+}
+
+// pcap with nanosecond timestamps, LINKTYPE_CAN_SOCKETCAN
+void cap_print_pcap(struct cap_header *hdr, struct cap_rec *rec, unsigned char *data) {
+  uint32_t pkt[4];
+  unsigned char frame[CANFD_MTU];
+  int len = (rec->flags & CANFD_FDF) ? CANFD_MTU : CAN_MTU;
+  memset(frame, 0, sizeof(frame));
+  frame[0] = rec->can_id >> 24; // The ID is big endian in this link type
+  frame[1] = rec->can_id >> 16;
+  frame[2] = rec->can_id >> 8;
+  frame[3] = rec->can_id;
+  frame[4] = rec->len;
+  frame[5] = rec->flags;
+  memcpy(&frame[8], data, rec->len);
+  pkt[0] = rec->ts_ns / 1000000000;
+  pkt[1] = rec->ts_ns % 1000000000;
+  pkt[2] = len;
+  pkt[3] = len;
+  fwrite(pkt, sizeof(pkt), 1, stdout);
+  fwrite(frame, len, 1, stdout);
+}
+
+int cap_convert(char *file, int pcap) {
+  uint32_t hdr[6] = { PCAP_MAGIC_NS, 0x00040002, 0, 0, CANFD_MTU, PCAP_LINKTYPE_CAN };
+  if(!pcap) return cap_read(file, cap_print_candump);
+  fwrite(hdr, sizeof(hdr), 1, stdout);
+  return cap_read(file, cap_print_pcap);
 }
 
 /*
-  Gateway
-*/
-void handle_vcds_710(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received VCDS 0x710 gateway request\n");
-  char resp[150];
-  if(frame.data[0] == 0x30) { // Flow control
-    flow_control_push_to(can,0x77A);
-    return;
-  }
-  switch(frame.data[1]) {
-    //Pkt: 710#02 10 03 55 55 55 55 55 
-    case 0x10: // Diagnostic Session Control
-      frame.can_id = 0x77A;
-      frame.len = 8;
-      frame.data[0] = 0x06;
-      frame.data[1] = 0x50;
-      frame.data[2] = 0x03;
-      frame.data[3] = 0x00;
-      frame.data[4] = 0x32;
-      frame.data[5] = 0x01;
-      frame.data[6] = 0xF4;
-      frame.data[7] = 0xAA;
-      write(can, &frame, CAN_MTU);
+ * Latency histograms.  Log-linear buckets (16 per power of two, so within
+ * ~6%) in microseconds, one set per (request CAN ID, SID).  "first" is the
+ * kernel receive time of the request to the first reply frame going out,
+ * "last" is to the final frame of the reply.  Flow control turnaround is
+ * kept under the pseudo SIDs LAT_FC_TO_CF and LAT_FF_TO_FC.
+ */
+int lat_bucket(uint64_t us) {
+  int e, msb;
+  if(us < 2 << LAT_SUB_BITS) return us;
+  msb = 63 - __builtin_clzll(us);
+  e = msb - LAT_SUB_BITS;
+  if((e << LAT_SUB_BITS) + (us >> e) >= LAT_BUCKETS) return LAT_BUCKETS - 1;
+  return (e << LAT_SUB_BITS) + (us >> e);
+}
+
+// Lowest value that lands in bucket i
+uint64_t lat_bucket_value(int i) {
+  int e;
+  if(i < 2 << LAT_SUB_BITS) return i;
+  e = (i >> LAT_SUB_BITS) - 1;
+  return (uint64_t)(i - (e << LAT_SUB_BITS)) << e;
+}
+
+void lat_record(struct lat_hist *h, uint64_t start_ns, uint64_t end_ns) {
+  uint64_t us = end_ns > start_ns ? (end_ns - start_ns) / 1000 : 0;
+  if(!h->count || us < h->min) h->min = us;
+  if(us > h->max) h->max = us;
+  h->count++;
+  h->sum += us;
+  h->buckets[lat_bucket(us)]++;
+}
+
+// Highest value of the bucket holding the pct percentile
+uint64_t lat_percentile(struct lat_hist *h, double pct) {
+  uint64_t want = h->count * pct / 100.0;
+  uint64_t seen = 0;
+  int i;
+  if(want >= h->count) want = h->count - 1;
+  for(i = 0; i < LAT_BUCKETS - 1; i++) {
+    seen += h->buckets[i];
+    if(seen > want) break;
+  }
+  if(lat_bucket_value(i + 1) - 1 > h->max) return h->max;
+  return lat_bucket_value(i + 1) - 1;
+}
+
+struct lat_entry *lat_lookup(canid_t can_id, int sid) {
+  unsigned int slot = ((can_id * 31) ^ sid) & (LAT_TABLE_SIZE - 1);
+  int i;
+  for(i = 0; i < LAT_TABLE_SIZE; i++, slot = (slot + 1) & (LAT_TABLE_SIZE - 1)) {
+    if(!lat_table[slot]) break;
+    if(lat_table[slot]->can_id == can_id && lat_table[slot]->sid == sid) return lat_table[slot];
+  }
+  if(i == LAT_TABLE_SIZE) return NULL;
+  lat_table[slot] = calloc(1, sizeof(struct lat_entry));
+  if(!lat_table[slot]) return NULL;
+  lat_table[slot]->can_id = can_id;
+  lat_table[slot]->sid = sid;
+  return lat_table[slot];
+}
+
+void lat_print_hist(char *name, struct lat_hist *h) {
+  if(!h->count) return;
+  plog("   %-5s n=%lu min=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu avg=%.1f (us)\n", name,
+       (unsigned long)h->count, (unsigned long)h->min,
+       (unsigned long)lat_percentile(h, 50), (unsigned long)lat_percentile(h, 90),
+       (unsigned long)lat_percentile(h, 99), (unsigned long)lat_percentile(h, 99.9),
+       (unsigned long)h->max, (double)h->sum / h->count);
+}
+
+void lat_dump() {
+  struct lat_entry *e;
+  int i;
+  for(i = 0; i < LAT_TABLE_SIZE; i++) {
+    e = lat_table[i];
+    if(!e || (!e->first.count && !e->last.count)) continue;
+    if(e->sid == LAT_FC_TO_CF) {
+      plog("Latency %03X ISO-TP flow control to next CF\n", e->can_id);
+    } else if(e->sid == LAT_FF_TO_FC) {
+      plog("Latency %03X ISO-TP first frame to our flow control\n", e->can_id);
+    } else {
+      plog("Latency %03X %02X %s\n", e->can_id, e->sid, sid_name(e->sid));
+    }
+    lat_print_hist("first", &e->first);
+    lat_print_hist("last", &e->last);
+  }
+}
+
+// Called around each handler so the transmit path can time the reply
+void lat_begin(struct uds_msg *msg) {
+  lat_cur = lat_lookup(msg->can_id, msg->data[1]);
+  lat_cur_ts = rx_cur_ts ? rx_cur_ts : realtime_ns();
+  lat_cur_sent = 0;
+  lat_cur_pending = 0;
+}
+
+void lat_end() {
+  if(lat_cur && lat_cur_sent && !lat_cur_pending) lat_record(&lat_cur->last, lat_cur_ts, realtime_ns());
+  lat_cur = NULL;
+}
+
+/*
+ * Transports.  Everything below can_send_frames() and recv_batch() is
+ * behind one of these so the protocol code runs the same on a real bus,
+ * in memory or from a capture.
+ */
+
+// Hands up to TX_BATCH frames to the kernel in one sendmmsg()
+int socketcan_send(struct transport *tp, struct canfd_frame *frames, int count) {
+  struct mmsghdr msgs[TX_BATCH];
+  struct iovec iov[TX_BATCH];
+  int i;
+  if(count > TX_BATCH) count = TX_BATCH;
+  memset(msgs, 0, sizeof(struct mmsghdr) * count);
+  for(i = 0; i < count; i++) {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = (frames[i].flags & CANFD_FDF) ? CANFD_MTU : CAN_MTU;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  return sendmmsg(tp->fd, msgs, count, 0);
+}
+
+// Pulls the kernel timestamp and drop counter out of a received frame
+uint64_t rx_cmsgs(struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  struct timespec *ts;
+  uint64_t ts_ns = 0;
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if(cmsg->cmsg_level != SOL_SOCKET) continue;
+    if(cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      ts = (struct timespec *)CMSG_DATA(cmsg);
+      ts_ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+    } else if(cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&rx_kernel_drops, CMSG_DATA(cmsg), sizeof(__u32));
+    }
+  }
+  return ts_ns;
+}
+
+// Reads everything that is waiting (up to max frames) in one syscall
+int socketcan_recv(struct transport *tp, struct canfd_frame *frames, uint64_t *ts, int max) {
+  uint64_t ts_ns;
+  int i, nframes;
+  if(max > rx_batch) max = rx_batch;
+  for(i = 0; i < max; i++) {
+    rx_iov[i].iov_base = &frames[i];
+    rx_msgs[i].msg_hdr.msg_controllen = RX_CTRLMSG_SIZE;
+    rx_msgs[i].msg_hdr.msg_flags = 0;
+  }
+  nframes = recvmmsg(tp->fd, rx_msgs, max, MSG_DONTWAIT, NULL);
+  if(nframes < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    return -1;
+  }
+  for(i = 0; i < nframes; i++) {
+    if(rx_msgs[i].msg_len != CAN_MTU && !(can_fd && rx_msgs[i].msg_len == CANFD_MTU)) {
+      fprintf(stderr, "read: incomplete CAN frame\n");
+      return -1;
+    }
+    ts_ns = rx_cmsgs(&rx_msgs[i].msg_hdr);
+    ts[i] = ts_ns ? ts_ns : realtime_ns();
+  }
+  return nframes;
+}
+
+int socketcan_set_filters(struct transport *tp, struct can_filter *filters, int count) {
+  return setsockopt(tp->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, count * sizeof(struct can_filter));
+}
+
+// Opens and binds a raw CAN socket.  Returns NULL on failure
+struct transport *socketcan_open(char *ifname) {
+  struct transport *tp;
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  int on = 1;
+  tp = calloc(1, sizeof(struct transport));
+  if(!tp) return NULL;
+  tp->name = ifname;
+  tp->send = socketcan_send;
+  tp->recv = socketcan_recv;
+  tp->set_filters = socketcan_set_filters;
+  tp->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(tp->fd < 0) {
+    perror("socket");
+    return NULL;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+  if (ioctl(tp->fd, SIOCGIFINDEX, &ifr) < 0) {
+    perror("SIOCGIFINDEX");
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+
+  if (can_fd) {
+    if (ioctl(tp->fd, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu != CANFD_MTU) {
+      fprintf(stderr, "%s: Interface does not support CAN FD\n", ifname);
+      return NULL;
+    }
+    if (setsockopt(tp->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &can_fd, sizeof(can_fd)) < 0) {
+      perror("CAN_RAW_FD_FRAMES");
+      return NULL;
+    }
+  }
+
+  if (bind(tp->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return NULL;
+  }
+
+  // Kernel receive timestamps drive the latency histograms and the capture
+  if (setsockopt(tp->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) perror("SO_RXQ_OVFL");
+  if (setsockopt(tp->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) perror("SO_TIMESTAMPNS");
+  return tp;
+}
+
+// Loopback: whatever is injected is received, whatever is sent is counted
+int loop_send(struct transport *tp, struct canfd_frame *frames, int count) {
+  struct loop_priv *lp = tp->priv;
+  lp->last_tx = frames[count - 1];
+  lp->tx_count += count;
+  return count;
+}
+
+int loop_recv(struct transport *tp, struct canfd_frame *frames, uint64_t *ts, int max) {
+  struct loop_priv *lp = tp->priv;
+  int n;
+  for(n = 0; n < max && lp->rx_tail != lp->rx_head; n++, lp->rx_tail++) {
+    frames[n] = lp->rx[lp->rx_tail & (LOOP_RING_SIZE - 1)];
+    ts[n] = realtime_ns();
+  }
+  return n;
+}
+
+// Queues a frame as if it came off the bus.  Returns -1 if the ring is full
+int loop_inject(struct transport *tp, struct canfd_frame *frame) {
+  struct loop_priv *lp = tp->priv;
+  if(lp->rx_head - lp->rx_tail >= LOOP_RING_SIZE) return -1;
+  lp->rx[lp->rx_head++ & (LOOP_RING_SIZE - 1)] = *frame;
+  return 0;
+}
+
+struct transport *loop_open() {
+  struct transport *tp = calloc(1, sizeof(struct transport));
+  if(!tp) return NULL;
+  tp->priv = calloc(1, sizeof(struct loop_priv));
+  if(!tp->priv) return NULL;
+  tp->name = "loopback";
+  tp->fd = -1;
+  tp->send = loop_send;
+  tp->recv = loop_recv;
+  return tp;
+}
+
+// Replay: the RX frames of a capture are received in order, as fast as we
+// can take them.  They are stamped when read so latency is our own
+// processing time.  Sends go nowhere
+int replay_send(struct transport *tp, struct canfd_frame *frames, int count) {
+  return count;
+}
+
+int replay_recv(struct transport *tp, struct canfd_frame *frames, uint64_t *ts, int max) {
+  struct cap_rec rec;
+  FILE *fp = tp->priv;
+  int n = 0;
+  while(n < max) {
+    if(fread(&rec, sizeof(rec), 1, fp) != 1) {
+      tp->closed = 1;
       break;
-    case 0x22: // Read Data By Identifier
-      if(frame.data[2] == 0xF1) {
-        switch(frame.data[3]) {
-        case 0x87: // VAG Number
-          if(verbose) plog("Read data by ID 0x87\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x43;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
-        break;
-        case 0x89: // VAG Number
-          if(verbose) plog("Read data by ID 0x89\n");
-          frame.can_id = 0x77A;
-          frame.len = 8;
-          frame.data[0] = 0x07;
-          frame.data[1] = 0x62;
-          frame.data[2] = 0xF1;
-          frame.data[3] = 0x89;
-          frame.data[4] = 0x33; //3
-          frame.data[5] = 0x32; //2
-          frame.data[6] = 0x30; //0
-          frame.data[7] = 0x33; //3
-          write(can, &frame, CAN_MTU);
-        break;
-        case 0x91: // VAG Number
-          if(verbose) plog("Read data by ID 0x91\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x41;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
-        break;
-        default:
-          if(verbose) plog("NOTE: Read data by unknown ID %02X\n", frame.data[3]);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x41;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
+    }
+    if(rec.len > CANFD_MAX_DLEN || fread(frames[n].data, 1, rec.len, fp) != rec.len) {
+      fprintf(stderr, "%s: Truncated capture\n", tp->name);
+      tp->closed = 1;
+      break;
+    }
+    if(rec.dir != CAP_RX) continue;
+    frames[n].can_id = rec.can_id;
+    frames[n].len = rec.len;
+    frames[n].flags = rec.flags;
+    ts[n++] = realtime_ns();
+  }
+  return n;
+}
+
+struct transport *replay_open(char *file) {
+  struct transport *tp;
+  struct cap_header hdr;
+  FILE *fp = fopen(file, "r");
+  if(!fp) {
+    perror(file);
+    return NULL;
+  }
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, CAP_MAGIC, sizeof(hdr.magic))) {
+    fprintf(stderr, "%s: Not a uds-server capture\n", file);
+    fclose(fp);
+    return NULL;
+  }
+  tp = calloc(1, sizeof(struct transport));
+  if(!tp) return NULL;
+  tp->name = file;
+  tp->fd = -1;
+  tp->send = replay_send;
+  tp->recv = replay_recv;
+  tp->priv = fp;
+  return tp;
+}
+
+/*
+ * All transmits go through here.  Frames are handed to the transport in as
+ * few calls as possible and failures are counted instead of printed per
+ * frame.  Returns the number of frames sent.
+ */
+int can_send_frames(struct transport *can, struct canfd_frame *frames, int count) {
+  uint64_t now = 0;
+  int sent = 0;
+  int i, ret;
+  while(sent < count) {
+    ret = can->send(can, &frames[sent], count - sent);
+    tx_calls++;
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      tx_errors += count - sent;
+      tx_last_errno = errno;
+      break;
+    }
+    if(cap_fd >= 0 || (lat_cur && !lat_cur_sent)) now = realtime_ns();
+    if(cap_fd >= 0) {
+      for(i = 0; i < ret; i++) cap_frame(&frames[sent + i], now, CAP_TX);
+    }
+    for(i = 0; i < ret; i++) {
+      if(frames[sent + i].can_id & CAN_EFF_FLAG) tx_eff++;
+      else tx_by_id[frames[sent + i].can_id & CAN_SFF_MASK]++;
+    }
+    if(lat_cur && !lat_cur_sent && ret > 0) {
+      lat_record(&lat_cur->first, lat_cur_ts, now);
+      lat_cur_sent = 1;
+    }
+    sent += ret;
+  }
+  tx_frames += sent;
+  return sent;
+}
+
+// Raw single frame replies from the handlers.  The ISO-TP code sends its
+// own frames with can_send_frames() so only replies get cached here
+int can_send(struct transport *can, struct canfd_frame *frame) {
+  if(cache_fill) resp_cache_record(frame->data, frame->len, frame->can_id, 0);
+  return can_send_frames(can, frame, 1);
+}
+
+// Smallest valid CAN FD data length that holds len bytes
+int canfd_len(int len) {
+  if(len <= 8) return len;
+  if(len <= 12) return 12;
+  if(len <= 16) return 16;
+  if(len <= 20) return 20;
+  if(len <= 24) return 24;
+  if(len <= 32) return 32;
+  if(len <= 48) return 48;
+  return 64;
+}
+
+struct canfd_frame *isotp_new_frame(struct canfd_frame *frame, int dest) {
+  memset(frame, 0, sizeof(struct canfd_frame));
+  frame->can_id = dest;
+  if(can_fd) frame->flags = CANFD_FDF;
+  return frame;
+}
+
+// Sets the frame length, padding up to a valid CAN FD length if needed
+void isotp_set_len(struct canfd_frame *frame, int len) {
+  frame->len = len;
+  if(!can_fd) return;
+  frame->len = canfd_len(len);
+  memset(&frame->data[len], ISOTP_PAD_BYTE, frame->len - len);
+}
+
+int isotp_tx_dl() {
+  return can_fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+}
+
+/*
+ * Builds the first frame of an ISO-TP message: a single frame if it fits,
+ * otherwise a first frame with a 12 bit length, or the 32 bit escape
+ * length for anything over 4095 bytes.  Returns the payload bytes used.
+ * In CAN FD mode frames carry up to 64 bytes (TX_DL = 64)
+ */
+int isotp_first_frame(struct canfd_frame *frame, unsigned char *data, int size, int dest) {
+  int tx_dl = isotp_tx_dl();
+  int hdr = 2;
+  int ff_dl;
+  isotp_new_frame(frame, dest);
+  if(size <= 7) {
+    isotp_set_len(frame, size + 1);
+    frame->data[0] = size;
+    memcpy(&frame->data[1], data, size);
+    return size;
+  }
+  if(size <= tx_dl - 2) { // CAN FD single frame, length moves to the 2nd byte
+    frame->data[0] = 0;
+    frame->data[1] = size;
+    memcpy(&frame->data[2], data, size);
+    isotp_set_len(frame, size + 2);
+    return size;
+  }
+  ff_dl = size;
+  if(fuzz_level > 2 && keep_spec == 0) {
+    fuzz_begin("ISO-TP first frame length");
+    ff_dl = fuzz_rand(ISOTP_FF_DL_MAX + 1);
+    printf("Breaking ISOTP specs real size = %d reported size = %d\n", size, ff_dl);
+  }
+  frame->len = tx_dl;
+  if(ff_dl <= ISOTP_FF_DL_MAX) {
+    frame->data[0] = ISOTP_FIRST_FRAME | (ff_dl >> 8);
+    frame->data[1] = ff_dl & 0xFF;
+  } else { // Escape sequence, FF_DL = 0 then a 32 bit length
+    frame->data[0] = ISOTP_FIRST_FRAME;
+    frame->data[1] = 0;
+    frame->data[2] = (ff_dl >> 24) & 0xFF;
+    frame->data[3] = (ff_dl >> 16) & 0xFF;
+    frame->data[4] = (ff_dl >> 8) & 0xFF;
+    frame->data[5] = ff_dl & 0xFF;
+    hdr = 6;
+  }
+  memcpy(&frame->data[hdr], data, tx_dl - hdr);
+  return tx_dl - hdr;
+}
+
+// Builds a consecutive frame from the next left bytes.  Returns the bytes used
+int isotp_consecutive_frame(struct canfd_frame *frame, unsigned char *data, int left, int seq, int dest) {
+  int tx_dl = isotp_tx_dl();
+  isotp_new_frame(frame, dest);
+  frame->data[0] = ISOTP_CONSECUTIVE_FRAME | (seq & 0x0F);
+  if(left > tx_dl - 1) {
+    frame->len = tx_dl;
+    memcpy(&frame->data[1], data, tx_dl - 1);
+    return tx_dl - 1;
+  }
+  memcpy(&frame->data[1], data, left);
+  isotp_set_len(frame, left + 1);
+  return left;
+}
+
+// STmin from a flow control frame in microseconds
+long isotp_stmin_us(unsigned char stmin) {
+  if(stmin <= 0x7F) return stmin * 1000;
+  if(stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100;
+  return 0x7F * 1000; // Reserved values are treated as the max STmin
+}
+
+/*
+ * ISO-TP sessions.  Every (request ID, response ID) pair gets its own send
+ * and receive state so transfers to different modules or testers never
+ * step on each other.
+ */
+struct isotp_session *isotp_find_session(int req_id, int resp_id, int create) {
+  struct isotp_session *s;
+  struct isotp_session *idle = NULL;
+  int i;
+  for(i = 0; i < isotp_nsessions; i++) {
+    s = isotp_sessions[i];
+    if(s->req_id == req_id && s->resp_id == resp_id) return s;
+    if(!idle && s->tx.state == ISOTP_IDLE && s->rx.state == ISOTP_IDLE) idle = s;
+  }
+  if(!create) return NULL;
+  if(isotp_nsessions < ISOTP_MAX_SESSIONS) {
+    s = calloc(1, sizeof(struct isotp_session));
+    if(!s) {
+      perror("isotp_find_session");
+      return NULL;
+    }
+    isotp_sessions[isotp_nsessions++] = s;
+  } else if(idle) { // Recycle a session that has nothing in flight, keeping its buffers
+    s = idle;
+    s->tx.state = ISOTP_IDLE;
+    s->rx.state = ISOTP_IDLE;
+  } else {
+    if(verbose) plog("ISOTP: Too many transfers in flight, dropping %03X->%03X\n", req_id, resp_id);
+    return NULL;
+  }
+  s->req_id = req_id;
+  s->resp_id = resp_id;
+  return s;
+}
+
+int isotp_sessions_active() {
+  int i, active = 0;
+  for(i = 0; i < isotp_nsessions; i++) {
+    if(isotp_sessions[i]->tx.state != ISOTP_IDLE || isotp_sessions[i]->rx.state != ISOTP_IDLE) active++;
+  }
+  return active;
+}
+
+void isotp_tx_abort(struct isotp_session *s, char *reason) {
+  if(verbose) plog("ISOTP %03X->%03X: Aborting transmit, %s\n", s->req_id, s->resp_id, reason);
+  s->tx.state = ISOTP_IDLE;
+  s->tx.lat = NULL;
+}
+
+// The rest of a multi-frame reply goes out later, so the session finishes
+// timing the request that is being handled
+void isotp_tx_lat_start(struct isotp_tx *tx) {
+  tx->lat = lat_cur;
+  tx->lat_ts = lat_cur_ts;
+  if(lat_cur) lat_cur_pending = 1;
+}
+
+// Sends the next consecutive frames.  With no STmin the rest of the block
+// goes out in batches, otherwise one frame and we come back when it's due
+void isotp_tx_continue(struct transport *can, struct isotp_session *s, uint64_t now) {
+  struct isotp_tx *tx = &s->tx;
+  struct canfd_frame frames[TX_BATCH];
+  unsigned char *data;
+  int count, left;
+  if(tx->frames) { // Cached reply, the frames are already built
+    count = tx->nframes - tx->next;
+    if(tx->block_size && count > tx->block_left) count = tx->block_left;
+    if(tx->stmin_us && count > 1) count = 1;
+    can_send_frames(can, &tx->frames[tx->next], count);
+    tx->next += count;
+    tx->block_left -= count;
+    left = tx->nframes - tx->next;
+  } else {
+    do {
+      for(count = 0; count < TX_BATCH && tx->offset < tx->size; count++) {
+        if(tx->block_size && count == tx->block_left) break;
+        if(tx->stmin_us && count == 1) break;
+        if(tx->seq_fault && --tx->seq_fault == 0) tx->seq += tx->seq_jump;
+        data = tx->ref ? &tx->ref[tx->offset - tx->ref_skip] : &tx->buf[tx->offset];
+        tx->offset += isotp_consecutive_frame(&frames[count], data, tx->size - tx->offset, tx->seq++, s->resp_id);
+      }
+      can_send_frames(can, frames, count);
+      tx->block_left -= count;
+    } while(count == TX_BATCH && tx->offset < tx->size && !tx->stmin_us && !(tx->block_size && tx->block_left == 0));
+    left = tx->size - tx->offset;
+  }
+  if(left <= 0) {
+    tx->state = ISOTP_IDLE;
+    if(tx->lat) lat_record(&tx->lat->last, tx->lat_ts, realtime_ns());
+    tx->lat = NULL;
+  } else if(tx->block_size && tx->block_left == 0) {
+    tx->state = ISOTP_WAIT_FC;
+    tx->deadline = now + ISOTP_N_BS_MS * 1000;
+  } else {
+    tx->state = ISOTP_SENDING;
+    tx->deadline = now + tx->stmin_us;
+  }
+}
+
+// Flow control from the tester.  It arrives on the request ID so it goes to
+// the transfer from this module that has been waiting the longest
+void isotp_handle_fc(struct transport *can, struct ecu *ecu, struct canfd_frame *frame) {
+  struct isotp_session *s = NULL;
+  struct isotp_tx *tx;
+  struct lat_entry *e;
+  uint64_t now = now_us();
+  int i;
+  if(no_flow_control) return;
+  for(i = 0; i < isotp_nsessions; i++) {
+    if(isotp_sessions[i]->req_id != ecu->req_id) continue;
+    if(isotp_sessions[i]->tx.state != ISOTP_WAIT_FC) continue;
+    if(!s || isotp_sessions[i]->tx.deadline < s->tx.deadline) s = isotp_sessions[i];
+  }
+  if(!s) {
+    if(verbose) plog("FC: No transfer waiting on flow control\n");
+    return;
+  }
+  tx = &s->tx;
+  switch(frame->data[0] & 0x0F) {
+    case ISOTP_FC_CTS:
+      tx->block_size = frame->len > 1 ? frame->data[1] : 0;
+      tx->block_left = tx->block_size;
+      tx->stmin_us = isotp_stmin_us(frame->len > 2 ? frame->data[2] : 0);
+      tx->wait_frames = 0;
+      if(verbose) plog("FC: Continue to send %03X BS=%d STmin=%ldus\n", s->resp_id, tx->block_size, tx->stmin_us);
+      isotp_tx_continue(can, s, now);
+      if((e = lat_lookup(frame->can_id, LAT_FC_TO_CF))) lat_record(&e->first, rx_cur_ts, realtime_ns());
+      break;
+    case ISOTP_FC_WAIT:
+      if(++tx->wait_frames > ISOTP_MAX_WFT) {
+        isotp_tx_abort(s, "too many FC Wait frames");
         break;
-       
       }
-    } else {
-      if (verbose) plog("Unknown read data by Identifier %02X\n", frame.data[2]);
+      if(verbose) plog("FC: Wait %03X\n", s->resp_id);
+      tx->deadline = now + ISOTP_N_BS_MS * 1000;
+      break;
+    case ISOTP_FC_OVERFLOW:
+      isotp_tx_abort(s, "receiver overflow");
+      break;
+    default:
+      isotp_tx_abort(s, "invalid flow status");
+      break;
+  }
+}
+
+// Consecutive frames follow once the tester's flow control arrives
+void isotp_tx_start(struct transport *can, struct isotp_session *s, int strategy) {
+  struct isotp_tx *tx = &s->tx;
+  tx->seq = 1;
+  tx->seq_fault = 0;
+  if(strategy == FUZZ_SEQ) camp_bad_seq(tx);
+  isotp_tx_lat_start(tx);
+  if(no_flow_control) {
+    tx->block_size = 0;
+    tx->stmin_us = 0;
+    isotp_tx_continue(can, s, now_us());
+    return;
+  }
+  tx->state = ISOTP_WAIT_FC;
+  tx->deadline = now_us() + ISOTP_N_BS_MS * 1000;
+}
+
+void isotp_send_to(struct transport *can, struct ecu *ecu, char *data, int size, int dest) {
+  struct isotp_session *s;
+  struct isotp_tx *tx;
+  struct canfd_frame frame;
+  unsigned char *buf;
+  int strategy = -1;
+  if(camp_cur_open) strategy = camp_mutate((unsigned char **)&data, &size, dest);
+  if(size > ISOTP_MAX_PDU) {
+    if(verbose) plog("ISOTP: Response of %d bytes is too big\n", size);
+    return;
+  }
+  if(cache_fill) resp_cache_record((unsigned char *)data, size, dest, 1);
+  s = isotp_find_session(ecu->req_id, dest, 1);
+  if(!s) return;
+  tx = &s->tx;
+  if(tx->state != ISOTP_IDLE) isotp_tx_abort(s, "new message queued");
+  tx->frames = NULL;
+  tx->offset = isotp_first_frame(&frame, (unsigned char *)data, size, dest);
+  if(strategy == FUZZ_LENGTH) camp_lie_len(&frame, size);
+  can_send_frames(can, &frame, 1);
+  if(tx->offset >= size) return;
+  // Keep our own copy, callers hand us stack buffers
+  if(size > tx->buf_size) {
+    buf = realloc(tx->buf, size);
+    if(!buf) {
+      perror("isotp_send_to");
+      return;
     }
-    break;
+    tx->buf = buf;
+    tx->buf_size = size;
+  }
+  memcpy(tx->buf, data, size);
+  tx->ref = NULL;
+  tx->size = size;
+  isotp_tx_start(can, s, strategy);
+}
+
+/*
+ * Sends a header then size bytes that are left where they are, an mmap'd
+ * image, instead of being copied for the transfer.  Only the first frame is
+ * put together here, the consecutive frames are built straight from data so
+ * it has to stay mapped until the transfer is done.
+ */
+void isotp_send_ref(struct transport *can, struct ecu *ecu, unsigned char *hdr, int hdr_len, unsigned char *data, int size, int dest) {
+  static unsigned char *flat = NULL;
+  static int flat_size = 0;
+  unsigned char first[CANFD_MAX_DLEN + 8];
+  struct isotp_session *s;
+  struct isotp_tx *tx;
+  struct canfd_frame frame;
+  unsigned char *buf;
+  int total = hdr_len + size;
+  if(total > ISOTP_MAX_PDU) {
+    if(verbose) plog("ISOTP: Response of %d bytes is too big\n", total);
+    return;
+  }
+  if(camp_cur_open || cache_fill) { // These need the whole reply in one piece
+    if(total > flat_size) {
+      buf = realloc(flat, total);
+      if(!buf) {
+        perror("isotp_send_ref");
+        return;
+      }
+      flat = buf;
+      flat_size = total;
+    }
+    memcpy(flat, hdr, hdr_len);
+    memcpy(flat + hdr_len, data, size);
+    isotp_send_to(can, ecu, (char *)flat, total, dest);
+    return;
+  }
+  s = isotp_find_session(ecu->req_id, dest, 1);
+  if(!s) return;
+  tx = &s->tx;
+  if(tx->state != ISOTP_IDLE) isotp_tx_abort(s, "new message queued");
+  tx->frames = NULL;
+  memcpy(first, hdr, hdr_len);
+  memcpy(first + hdr_len, data, size < CANFD_MAX_DLEN ? size : CANFD_MAX_DLEN);
+  tx->offset = isotp_first_frame(&frame, first, total, dest);
+  can_send_frames(can, &frame, 1);
+  if(tx->offset >= total) return;
+  tx->ref = data;
+  tx->ref_skip = hdr_len;
+  tx->size = total;
+  isotp_tx_start(can, s, -1);
+}
+
+// Our flow control for a multi-frame request.  We never ask for pauses
+void isotp_send_fc(struct transport *can, int dest, int status) {
+  struct canfd_frame frame;
+  isotp_new_frame(&frame, dest);
+  frame.len = 3;
+  frame.data[0] = ISOTP_FLOW_CONTROL | status;
+  frame.data[1] = 0; // BS
+  frame.data[2] = 0; // STmin
+  can_send_frames(can, &frame, 1);
+}
+
+// Sends a message that is already split into frames (see the reply cache)
+void isotp_send_frames(struct transport *can, struct ecu *ecu, struct canfd_frame *frames, int nframes, int dest) {
+  struct isotp_session *s;
+  struct isotp_tx *tx;
+  s = isotp_find_session(ecu->req_id, dest, 1);
+  if(!s) return;
+  tx = &s->tx;
+  if(tx->state != ISOTP_IDLE) isotp_tx_abort(s, "new message queued");
+  tx->frames = frames;
+  tx->nframes = nframes;
+  tx->next = 1;
+  can_send_frames(can, frames, 1);
+  if(nframes < 2) return;
+  isotp_tx_lat_start(tx);
+  if(no_flow_control) {
+    tx->block_size = 0;
+    tx->stmin_us = 0;
+    isotp_tx_continue(can, s, now_us());
+    return;
+  }
+  tx->state = ISOTP_WAIT_FC;
+  tx->deadline = now_us() + ISOTP_N_BS_MS * 1000;
+}
+
+/*
+ * Reply cache.  Handlers for static replies (supported PIDs, VIN, part
+ * numbers...) are run once per distinct request and whatever they send is
+ * kept as wire frames.  After that a matching request just sends the
+ * stored frames.  Fuzzing makes every reply different so it is off then.
+ */
+// The request's own length and bytes, padding after the PCI length never
+// counts.  Only requests of up to 3 bytes are cached (see dispatch_msg)
+uint32_t resp_cache_key(struct uds_msg *msg) {
+  int len = msg_payload_len(msg);
+  uint32_t key = len > 4 ? 4 : len;
+  int i;
+  for(i = 1; i < 4; i++) key = (key << 8) | (i <= len ? msg->data[i] : 0);
+  return key;
+}
+
+struct resp_cache *resp_cache_lookup(struct ecu *ecu, uint32_t key) {
+  int i;
+  for(i = 0; i < ecu->ncache; i++) {
+    if(ecu->cache[i].key == key) return &ecu->cache[i];
+  }
+  return NULL;
+}
+
+// Called from the transmit path while cache_fill is set
+void resp_cache_record(unsigned char *data, int size, int dest, int isotp) {
+  struct resp_cache *c = cache_fill;
+  int nframes, offset, seq;
+  int tx_dl = isotp_tx_dl();
+  if(++cache_fill_replies > 1) return; // Only single replies are cached
+  if(!isotp) {
+    c->frames = malloc(sizeof(struct canfd_frame));
+    if(!c->frames) return;
+    isotp_new_frame(c->frames, dest);
+    c->frames->flags = 0; // Raw replies are always classic frames
+    c->frames->len = size;
+    memcpy(c->frames->data, data, size);
+    c->nframes = 1;
+    c->dest = dest;
+    return;
+  }
+  // Worst case: the first frame carries tx_dl-6 bytes, every CF tx_dl-1
+  nframes = 2 + size / (tx_dl - 1);
+  c->frames = calloc(nframes, sizeof(struct canfd_frame));
+  if(!c->frames) return;
+  offset = isotp_first_frame(&c->frames[0], data, size, dest);
+  c->nframes = 1;
+  for(seq = 1; offset < size; seq++) {
+    offset += isotp_consecutive_frame(&c->frames[c->nframes++], &data[offset], size - offset, seq, dest);
+  }
+  c->isotp = c->nframes > 1;
+  c->dest = dest;
+}
+
+// Sends the cached reply for msg.  Returns 0 if there isn't one
+int resp_cache_send(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct resp_cache *c = resp_cache_lookup(ecu, resp_cache_key(msg));
+  if(!c) return 0;
+  cache_hits++;
+  if(verbose > 1) plog("Replying to %s from cache\n", ecu->name);
+  if(!c->isotp && c->frames[0].data[1] == 0x7F && c->frames[0].len > 3) nrc_sent[c->frames[0].data[3]]++;
+  if(c->isotp) {
+    isotp_send_frames(can, ecu, c->frames, c->nframes, c->dest);
+  } else {
+    can_send_frames(can, c->frames, c->nframes);
+  }
+  return 1;
+}
+
+// Runs the handler and keeps its reply for next time
+void resp_cache_fill(struct transport *can, struct uds_msg *msg, struct ecu *ecu, uds_handler handler) {
+  struct resp_cache *c;
+  cache_misses++;
+  if(!ecu->cache) ecu->cache = calloc(RESP_CACHE_MAX, sizeof(struct resp_cache));
+  if(!ecu->cache || ecu->ncache >= RESP_CACHE_MAX) {
+    handler(can, msg, ecu);
+    return;
+  }
+  c = &ecu->cache[ecu->ncache];
+  memset(c, 0, sizeof(struct resp_cache));
+  c->key = resp_cache_key(msg);
+  cache_fill = c;
+  cache_fill_replies = 0;
+  handler(can, msg, ecu);
+  cache_fill = NULL;
+  if(cache_fill_replies == 1 && c->frames) {
+    ecu->ncache++;
+  } else {
+    free(c->frames);
+  }
+}
+
+// Drops every cached reply.  Call this when the VIN or profile changes
+void resp_cache_flush() {
+  struct ecu *ecu;
+  int i, j;
+  // Nothing may still be sending from the frames we are about to free
+  for(i = 0; i < isotp_nsessions; i++) {
+    if(isotp_sessions[i]->tx.frames && isotp_sessions[i]->tx.state != ISOTP_IDLE)
+      isotp_tx_abort(isotp_sessions[i], "reply cache flushed");
+    isotp_sessions[i]->tx.frames = NULL;
+  }
+  for(i = 0; i < MAX_CAN_ID; i++) {
+    ecu = ecu_by_id[i];
+    if(!ecu || !ecu->ncache) continue;
+    for(j = 0; j < ecu->ncache; j++) free(ecu->cache[j].frames);
+    ecu->ncache = 0;
+  }
+}
+
+// Drops the cached reply to one request, a DID that was just written say
+void resp_cache_drop(struct ecu *ecu, struct uds_msg *msg) {
+  struct resp_cache *c = resp_cache_lookup(ecu, resp_cache_key(msg));
+  int i;
+  if(!c) return;
+  for(i = 0; i < isotp_nsessions; i++) {
+    if(isotp_sessions[i]->tx.frames != c->frames) continue;
+    if(isotp_sessions[i]->tx.state != ISOTP_IDLE) isotp_tx_abort(isotp_sessions[i], "cached reply dropped");
+    isotp_sessions[i]->tx.frames = NULL;
+  }
+  free(c->frames);
+  *c = ecu->cache[--ecu->ncache];
+}
+
+void isotp_rx_first(struct transport *can, struct ecu *ecu, struct canfd_frame *frame) {
+  struct isotp_session *s;
+  struct isotp_rx *rx;
+  struct lat_entry *e;
+  unsigned char *buf;
+  int size = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+  int hdr = 2;
+  if(size == 0 && frame->len >= 8) { // 32 bit escape length
+    size = (frame->data[2] << 24) | (frame->data[3] << 16) | (frame->data[4] << 8) | frame->data[5];
+    if(size < 0) size = ISOTP_MAX_PDU + 1;
+    hdr = 6;
+  }
+  if(frame->len < 8 || size < 8) {
+    if(verbose) plog("ISOTP: Ignoring malformed first frame\n");
+    return;
+  }
+  if(size > ISOTP_MAX_PDU) {
+    if(verbose) plog("ISOTP: Request of %d bytes is too big\n", size);
+    isotp_send_fc(can, ecu->resp_id, ISOTP_FC_OVERFLOW);
+    return;
+  }
+  s = isotp_find_session(ecu->req_id, ecu->resp_id, 1);
+  if(!s) {
+    isotp_send_fc(can, ecu->resp_id, ISOTP_FC_OVERFLOW);
+    return;
+  }
+  rx = &s->rx;
+  if(size + 1 > rx->buf_size) {
+    buf = realloc(rx->buf, size + 1);
+    if(!buf) {
+      perror("isotp_rx_first");
+      isotp_send_fc(can, ecu->resp_id, ISOTP_FC_OVERFLOW);
+      return;
+    }
+    rx->buf = buf;
+    rx->buf_size = size + 1;
+  }
+  if(rx->state == ISOTP_RECEIVING && verbose) plog("ISOTP %03X->%03X: New first frame, dropping unfinished request\n", s->req_id, s->resp_id);
+  rx->can_id = frame->can_id;
+  rx->size = size;
+  rx->buf[0] = 0;
+  rx->received = frame->len - hdr; // 6 bytes, or 62 on CAN FD
+  if(rx->received > size) rx->received = size;
+  memcpy(&rx->buf[1], &frame->data[hdr], rx->received);
+  rx->seq = 1;
+  rx->deadline = now_us() + ISOTP_N_CR_MS * 1000;
+  rx->state = ISOTP_RECEIVING;
+  isotp_send_fc(can, ecu->resp_id, ISOTP_FC_CTS);
+  if((e = lat_lookup(frame->can_id, LAT_FF_TO_FC))) lat_record(&e->first, rx_cur_ts, realtime_ns());
+}
+
+void isotp_rx_consecutive(struct transport *can, struct ecu *ecu, struct canfd_frame *frame) {
+  struct isotp_session *s;
+  struct isotp_rx *rx;
+  struct uds_msg msg;
+  int len;
+  s = isotp_find_session(ecu->req_id, ecu->resp_id, 0);
+  if(!s || s->rx.state != ISOTP_RECEIVING) return;
+  rx = &s->rx;
+  if((frame->data[0] & 0x0F) != rx->seq) {
+    if(verbose) plog("ISOTP %03X->%03X: Wrong sequence number %X (expected %X), dropping request\n",
+                     s->req_id, s->resp_id, frame->data[0] & 0x0F, rx->seq);
+    rx->state = ISOTP_IDLE;
+    return;
+  }
+  len = rx->size - rx->received;
+  if(len > frame->len - 1) len = frame->len - 1;
+  memcpy(&rx->buf[1 + rx->received], &frame->data[1], len);
+  rx->received += len;
+  rx->seq = (rx->seq + 1) & 0x0F;
+  rx->deadline = now_us() + ISOTP_N_CR_MS * 1000;
+  if(rx->received < rx->size) return;
+  rx->state = ISOTP_IDLE;
+  msg.can_id = rx->can_id;
+  msg.len = rx->size + 1;
+  msg.data = rx->buf;
+  dispatch_msg(can, &msg, ecu);
+}
+
+// Handles anything that is due: paced consecutive frames and timeouts
+void isotp_poll(struct transport *can) {
+  struct isotp_session *s;
+  uint64_t now = 0;
+  int i;
+  for(i = 0; i < isotp_nsessions; i++) {
+    s = isotp_sessions[i];
+    if(s->tx.state == ISOTP_IDLE && s->rx.state == ISOTP_IDLE) continue;
+    if(!now) now = now_us();
+    if(s->tx.state == ISOTP_SENDING && now >= s->tx.deadline) {
+      record_jitter(&isotp_jitter, s->tx.deadline, now);
+      isotp_tx_continue(can, s, now);
+    } else if(s->tx.state == ISOTP_WAIT_FC && now >= s->tx.deadline) {
+      isotp_tx_abort(s, "N_Bs timeout waiting for flow control");
+    }
+    if(s->rx.state == ISOTP_RECEIVING && now >= s->rx.deadline) {
+      if(verbose) plog("ISOTP %03X->%03X: N_Cr timeout waiting for consecutive frame\n", s->req_id, s->resp_id);
+      s->rx.state = ISOTP_IDLE;
+    }
+  }
+}
+
+// Earliest ISO-TP deadline or 0 if nothing is pending
+uint64_t isotp_next_deadline() {
+  struct isotp_session *s;
+  uint64_t deadline = 0;
+  int i;
+  for(i = 0; i < isotp_nsessions; i++) {
+    s = isotp_sessions[i];
+    if(s->tx.state != ISOTP_IDLE && (!deadline || s->tx.deadline < deadline)) deadline = s->tx.deadline;
+    if(s->rx.state != ISOTP_IDLE && (!deadline || s->rx.deadline < deadline)) deadline = s->rx.deadline;
+  }
+  return deadline;
+}
+
+/*
+ * Periodic data.  GM 0xAA and UDS 0x2A ask for DIDs to be sent at a slow,
+ * medium or fast rate until told to stop.  Every (module, DID) is its own
+ * stream and all streams sit in one min-heap on their next due time, so
+ * starting or stopping one is O(log n) and a tick only looks at the ones
+ * that are due.  Each module finds its streams by DID in O(1).
+ */
+void periodic_swap(int a, int b) {
+  struct periodic *p = periodic_heap[a];
+  periodic_heap[a] = periodic_heap[b];
+  periodic_heap[b] = p;
+  periodic_heap[a]->heap_idx = a;
+  periodic_heap[b]->heap_idx = b;
+}
+
+void periodic_sift_up(int i) {
+  while(i > 0 && periodic_heap[i]->due < periodic_heap[(i - 1) / 2]->due) {
+    periodic_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void periodic_sift_down(int i) {
+  int child;
+  while((child = 2 * i + 1) < periodic_count) {
+    if(child + 1 < periodic_count && periodic_heap[child + 1]->due < periodic_heap[child]->due) child++;
+    if(periodic_heap[i]->due <= periodic_heap[child]->due) break;
+    periodic_swap(i, child);
+    i = child;
+  }
+}
+
+// Starts sending did from ecu every period_us, or changes the rate if it already is
+int periodic_add(struct ecu *ecu, int type, canid_t can_id, int did, long period_us) {
+  struct periodic **heap;
+  struct periodic *p;
+  if(!ecu->periodic) {
+    ecu->periodic = calloc(256, sizeof(struct periodic *));
+    if(!ecu->periodic) {
+      perror("periodic_add");
+      return -1;
+    }
+  }
+  p = ecu->periodic[did & 0xFF];
+  if(!p) {
+    if(periodic_count == periodic_size) {
+      heap = realloc(periodic_heap, (periodic_size + 64) * sizeof(struct periodic *));
+      if(!heap) {
+        perror("periodic_add");
+        return -1;
+      }
+      if(!periodic_size) rng_seed(&periodic_rng, fuzz_seed, ~0ULL);
+      periodic_heap = heap;
+      periodic_size += 64;
+    }
+    p = calloc(1, sizeof(struct periodic));
+    if(!p) {
+      perror("periodic_add");
+      return -1;
+    }
+    p->ecu = ecu;
+    p->did = did & 0xFF;
+    p->heap_idx = periodic_count;
+    periodic_heap[periodic_count++] = p;
+    ecu->periodic[did & 0xFF] = p;
+  }
+  p->type = type;
+  p->can_id = can_id;
+  p->period_us = period_us;
+  p->due = now_us(); // First one goes out on the next tick
+  periodic_sift_up(p->heap_idx);
+  periodic_sift_down(p->heap_idx);
+  return 0;
+}
+
+// Stops one DID, or every stream of ecu when did is -1
+void periodic_stop(struct ecu *ecu, int did) {
+  struct periodic *p;
+  int i, idx;
+  if(!ecu->periodic) return;
+  for(i = did < 0 ? 0 : did & 0xFF; i < 256; i++) {
+    p = ecu->periodic[i];
+    if(p) { // Last stream in the heap takes its place
+      ecu->periodic[i] = NULL;
+      idx = p->heap_idx;
+      if(idx != --periodic_count) {
+        periodic_swap(idx, periodic_count);
+        periodic_sift_up(idx);
+        periodic_sift_down(idx);
+      }
+      free(p);
+    }
+    if(did >= 0) break;
+  }
+}
+
+void periodic_frame(struct canfd_frame *frame, struct periodic *p) {
+  uint64_t bits = rng_next(&periodic_rng);
+  int i;
+  memset(frame, 0, sizeof(struct canfd_frame));
+  frame->can_id = p->can_id;
+  frame->len = 8;
+  frame->data[0] = p->did;
+  for(i = 1; i < 8; i++, bits >>= 8) frame->data[i] = bits; // Bogus data
+  if(verbose > 1) plog("  + Sending %s periodic data (%02X) every %ldms\n",
+                       p->type == PERIODIC_GM ? "GM" : "UDS", p->did, p->period_us / 1000);
+}
+
+// Sends everything that is due in as few writes as possible
+void handle_periodic(struct transport *can) {
+  struct canfd_frame frames[TX_BATCH];
+  struct periodic *p;
+  uint64_t now;
+  int count = 0;
+  if(!periodic_count) return;
+  now = now_us();
+  while(periodic_count && periodic_heap[0]->due <= now) {
+    p = periodic_heap[0];
+    record_jitter(&periodic_jitter, p->due, now);
+    periodic_frame(&frames[count++], p);
+    if(count == TX_BATCH) {
+      can_send_frames(can, frames, count);
+      count = 0;
+    }
+    // Schedule from when it was due, not when we got to it, so there is no drift
+    p->due += p->period_us;
+    if(p->due <= now) p->due = now + p->period_us; // Too far behind to catch up
+    periodic_sift_down(0);
+  }
+  if(count) can_send_frames(can, frames, count);
+}
+
+uint64_t periodic_next_deadline() {
+  return periodic_count ? periodic_heap[0]->due : 0;
+}
+
+/*
+ * Streamed replies.  Replies that are a long run of raw frames with pauses
+ * in between (GM DTCs, GM one response data) are jobs the main loop sends
+ * a frame at a time when they are due, so nothing else waits on them.
+ * A module has at most one job per SID and a new request replaces it.
+ */
+struct tx_job *job_start(struct ecu *ecu, int sid, int type, struct canfd_frame *frame, long first_us, long gap_us) {
+  struct tx_job *job = NULL;
+  int i;
+  for(i = 0; i < tx_njobs; i++) {
+    if(tx_jobs[i]->ecu == ecu && tx_jobs[i]->sid == sid) {
+      if(verbose) plog("%s: Replacing the unfinished %02X %s reply\n", ecu->name, sid, sid_name(sid));
+      job = tx_jobs[i];
+      break;
+    }
+  }
+  if(!job) {
+    if(tx_njobs == TX_JOB_MAX) {
+      if(verbose) plog("Too many streamed replies, dropping %02X %s\n", sid, sid_name(sid));
+      return NULL;
+    }
+    job = malloc(sizeof(struct tx_job));
+    if(!job) {
+      perror("job_start");
+      return NULL;
+    }
+    tx_jobs[tx_njobs++] = job;
+  }
+  memset(job, 0, sizeof(struct tx_job));
+  job->ecu = ecu;
+  job->sid = sid;
+  job->type = type;
+  job->frame = *frame;
+  job->gap_us = gap_us;
+  job->due = now_us() + first_us;
+  return job;
+}
+
+void job_free(struct tx_job *job) {
+  int i;
+  for(i = 0; i < tx_njobs; i++) {
+    if(tx_jobs[i] == job) {
+      tx_jobs[i] = tx_jobs[--tx_njobs];
+      break;
+    }
+  }
+  free(job);
+}
+
+// Stops the job for sid, or every job of ecu when sid is -1
+void job_cancel(struct ecu *ecu, int sid) {
+  int i;
+  for(i = tx_njobs - 1; i >= 0; i--) {
+    if(tx_jobs[i]->ecu != ecu || (sid >= 0 && tx_jobs[i]->sid != sid)) continue;
+    if(verbose) plog("%s: Cancelled the %02X %s reply\n", ecu->name, tx_jobs[i]->sid, sid_name(tx_jobs[i]->sid));
+    job_free(tx_jobs[i]);
+  }
+}
+
+// Builds the job's next frame.  Returns 0 when that was its last one
+int job_next(struct tx_job *job, struct canfd_frame *frame) {
+  int i;
+  *frame = job->frame;
+  switch(job->type) {
+    case JOB_GM_DTC:
+      if(!job->left) { // Last frame must be a 0 DTC
+        frame->data[1] = 0;
+        frame->data[2] = 0;
+        frame->data[3] = 0;
+        frame->data[4] = 0xFF; // Last DTC
+        return 0;
+      }
+      frame->data[1] = rng_range(&job->rng, 256);
+      frame->data[2] = rng_range(&job->rng, 255) + 1;
+      frame->data[3] = 0;
+      frame->data[4] = 0x6F;
+      break;
+    case JOB_GM_DATA:
+      frame->data[0] = job->dpids[job->ndpids - job->left];
+      for(i = 1; i < 8; i++) frame->data[i] = rng_range(&job->rng, 256);
+      if(job->left == 1) return 0;
+      break;
+  }
+  job->left--;
+  return 1;
+}
+
+void handle_jobs(struct transport *can) {
+  struct canfd_frame frames[TX_BATCH];
+  struct tx_job *job;
+  uint64_t now;
+  int i, count = 0;
+  if(!tx_njobs) return;
+  now = now_us();
+  for(i = 0; i < tx_njobs && count < TX_BATCH; i++) {
+    job = tx_jobs[i];
+    if(now < job->due) continue;
+    record_jitter(&job_jitter, job->due, now);
+    if(job_next(job, &frames[count++])) {
+      job->due += job->gap_us;
+      if(job->due <= now) job->due = now + job->gap_us;
+    } else {
+      job_free(job);
+      i--; // The last job took its slot
+    }
+  }
+  if(count) can_send_frames(can, frames, count);
+}
+
+uint64_t job_next_deadline() {
+  uint64_t deadline = 0;
+  int i;
+  for(i = 0; i < tx_njobs; i++) {
+    if(!deadline || tx_jobs[i]->due < deadline) deadline = tx_jobs[i]->due;
+  }
+  return deadline;
+}
+
+// Earliest time anything needs to go out, 0 if nothing is scheduled
+uint64_t next_deadline() {
+  uint64_t deadline = isotp_next_deadline();
+  uint64_t pending = periodic_next_deadline();
+  uint64_t jobs = job_next_deadline();
+  uint64_t camp = camp_mask ? camp_next_deadline() : 0;
+  if(pending && (!deadline || pending < deadline)) deadline = pending;
+  if(jobs && (!deadline || jobs < deadline)) deadline = jobs;
+  if(camp && (!deadline || camp < deadline)) deadline = camp;
+  return deadline;
+}
+
+// Arms the timerfd for an absolute CLOCK_MONOTONIC deadline, 0 disarms it
+void arm_timer(int tfd, uint64_t deadline) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if(deadline) {
+    its.it_value.tv_sec = deadline / 1000000;
+    its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+  }
+  if(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) perror("timerfd_settime");
+}
+
+void send_dtcs(struct transport *can, char total, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[1024];
+  char i;
+  memset(resp, 0, 1024);
+  switch(fuzz_level) {
+    case 0:  // Default is to make P01XX where XX = total number of DTCs
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = total; // Total DTCs
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = 1;
+        resp[2+i+1] = i;
+      }
+      if(total == 0) {
+        isotp_send_to(can, ecu, resp, 2, ecu->resp_id);
+      } else if (total < 3) {
+        isotp_send_to(can, ecu, resp, 2+(total*2), ecu->resp_id);
+      } else {
+        isotp_send_to(can, ecu, resp, total*2, ecu->resp_id);
+      }
+      break;
+    case 1:
+      fuzz_begin("DTC count");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = fuzz_rand(256);
+      if (verbose) plog("Randomized total DTCs to %d real DTCs %d\n", resp[1], total);
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = 1;
+        resp[2+i+1] = i;
+      }
+      if(total == 0) {
+        isotp_send_to(can, ecu, resp, 2, ecu->resp_id);
+      } else if (total < 3) {
+        isotp_send_to(can, ecu, resp, 2+(total*2), ecu->resp_id);
+      } else {
+        isotp_send_to(can, ecu, resp, total*2, ecu->resp_id);
+      }
+      break;
+    case 2:
+    default:
+      fuzz_begin("DTC count and data");
+      resp[0] = msg->data[1] + 0x40;
+      total = fuzz_rand(128);
+      resp[1] = total;
+      if (verbose) plog("Randomized total DTCs to %d\n", resp[1]);
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = fuzz_rand(256);
+        resp[2+i+1] = fuzz_rand(256);
+      }
+      if (verbose) {
+        plog("DTC random data is:\n");
+        print_bin(&resp[2], total*2);
+      }
+      if(total == 0) {
+        isotp_send_to(can, ecu, resp, 2, ecu->resp_id);
+      } else if (total < 3) {
+        isotp_send_to(can, ecu, resp, 2+(total*2), ecu->resp_id);
+      } else {
+        isotp_send_to(can, ecu, resp, total*2, ecu->resp_id);
+      }
+      break;
+  }
+}
+
+unsigned char calc_vin_checksum(char *vin, int size) {
+  char w[17] = { 8, 7, 6, 5, 4, 3, 2, 10, 0, 9, 8, 7, 6, 5, 4, 3, 2 };
+  int i;
+  int checksum = 0;
+  int num;
+  for(i=0; i < size && i < 17; i++) {
+    num = 0;
+    if(vin[i] == 'I' || vin[i] == 'O' || vin[i] == 'Q') {
+      num = 0;
+    } else {
+      if(vin[i] >= '0' && vin[i] <='9') num = vin[i] - '0';
+      if(vin[i] >= 'A' && vin[i] <='I') num = (vin[i] - 'A') + 1;
+      if(vin[i] >= 'J' && vin[i] <='R') num = (vin[i] - 'J') + 1;
+      if(vin[i] >= 'S' && vin[i] <='Z') num = (vin[i] - 'S') + 2;
+    }
+    checksum += num * w[i];
+  }
+  checksum = checksum % 11;
+  if (checksum == 10) return 'X';
+  return ('0' + checksum);
+}
+
+void send_error_snfs(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[4];
+  if(verbose) plog("Responded with Sub Function Not Supported\n");
+  resp[0] = 0x7f;
+  resp[1] = msg->data[1];
+  resp[2] = 0x12; // SubFunctionNotSupported
+  nrc_sent[0x12]++;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+void send_error_roor(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[4];
+  if(verbose) plog("Responded with Request Out Of Range\n");
+  resp[0] = 0x7f;
+  resp[1] = msg->data[1];
+  resp[2] = 0x31; // RequestOutOfRange
+  nrc_sent[0x31]++;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+void send_error_imlf(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[4];
+  if(verbose) plog("Responded with Incorrect Message Length Or Invalid Format\n");
+  resp[0] = 0x7f;
+  resp[1] = msg->data[1];
+  resp[2] = 0x13; // IncorrectMessageLengthOrInvalidFormat
+  nrc_sent[0x13]++;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+// Negative response with any other code
+void send_error_nrc(struct transport *can, struct uds_msg *msg, struct ecu *ecu, int nrc) {
+  char resp[4];
+  if(verbose) plog("Responded with NRC %02X\n", nrc);
+  resp[0] = 0x7f;
+  resp[1] = msg->data[1];
+  resp[2] = nrc;
+  nrc_sent[nrc]++;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+void generic_OK_resp_to(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[4];
+  if(verbose > 1) plog("Responding with a generic OK message\n");
+  resp[0] = msg->data[1] + 0x40;
+  resp[1] = msg->data[2];
+  resp[2] = 0;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+void handle_current_data(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received Current info request\n");
+  char resp[8];
+  switch(msg->data[2]) {
+    case 0x00: // Supported PIDs
+      if(verbose) plog("Responding with a generic set of PIDs (1-20)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x01: // MIL & DTC Status
+      if(verbose) plog("Responding to MIL and DTC Status request\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0x00;
+      resp[3] = 0x07;
+      resp[4] = 0xE5;
+      resp[5] = 0xE5;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x20: // More supported PIDs (21-40)
+      if(verbose) plog("Responding with PIDs supported (21-40)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x40: // More supported PIDs (41-60)
+      if(verbose) plog("Responding with PIDs supported (41-60)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x41: // Monitor status this drive cycle
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0;
+      resp[3] = 0x0F;
+      resp[4] = 0xFF;
+      resp[5] = 0x00;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x60: // More supported PIDs (61-80)
+      if(verbose) plog("Responding with PIDs supported (61-80)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x80: // More supported PIDs (81-100)
+      if(verbose) plog("Responding with PIDs supported (81-100)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0xA0:  // More Supported PIDs (101-120)
+      if(verbose) plog("Responding with PIDs supported (101-120)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0xC0: // More supported PIDs (121-140)
+      if(verbose) plog("Responding with PIDs supported (121-140)\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    default:
+      if(verbose) plog("Note: Requested unsupported service %02X\n", msg->data[2]);
+      break;
+  }
+}
+
+void handle_vehicle_info(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  int pktsize = 0;
+  if(verbose) plog("Received Vehicle info request\n");
+  char resp[300];
+  switch(msg->data[2]) {
+    case 0x00: // Supported PIDs
+      if(verbose) plog("Replying with ALL Pids supported\n");
+      resp[0] = msg->data[1] + 0x40;
+      resp[1] = msg->data[2];
+      resp[2] = 0x55;
+      resp[3] = 0;
+      resp[4] = 0;
+      resp[5] = 0;
+      isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+      break;
+    case 0x02: // Get VIN
+      switch(fuzz_level) {
+        case 0:
+          if(verbose) plog("Sending VIN %s\n", vin);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 1;
+          memcpy(&resp[3], vin, strlen(vin));
+          isotp_send_to(can, ecu, resp, 4 + strlen(vin), ecu->resp_id);
+          break;
+        case 1:
+          fuzz_begin("VIN with printable chars");
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 1;
+          gen_data(DATA_ALPHANUM, (unsigned char *)&resp[3], 17);
+          resp[3 + 8] = calc_vin_checksum(&resp[3], 17);
+          if(verbose) plog("Using VIN: %.17s\n", &resp[3]);
+          isotp_send_to(can, ecu, resp, 4 + 17, ecu->resp_id);
+          break;
+        case 2:
+        case 3:  // At 3 the ISOTP spec gets flaky
+          fuzz_begin("big VIN with printable chars");
+          pktsize = fuzz_rand(252);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 1;
+          gen_data(DATA_ALPHANUM, (unsigned char *)&resp[3], pktsize);
+          resp[3 + 8] = calc_vin_checksum(&resp[3], pktsize);
+          if(verbose) plog("Using big VIN (%d chars): %.*s\n", pktsize, pktsize, &resp[3]);
+          isotp_send_to(can, ecu, resp, 4 + pktsize, ecu->resp_id);
+          break;
+        case 4:
+          fuzz_begin("VIN with binary data");
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 1;
+          gen_data(DATA_BINARY, (unsigned char *)&resp[3], 17);
+          resp[3 + 8] = calc_vin_checksum(&resp[3], 17);
+          if(verbose) print_bin((unsigned char *)&resp[3], 17);
+          isotp_send_to(can, ecu, resp, 4 + 17, ecu->resp_id);
+          break;
+        case 5:
+        default:
+          fuzz_begin("VIN with binary data and size");
+          pktsize = fuzz_rand(252);
+          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 1;
+          gen_data(DATA_BINARY, (unsigned char *)&resp[3], pktsize);
+          if(verbose) print_bin((unsigned char *)&resp[3], pktsize);
+          isotp_send_to(can, ecu, resp, 4 + pktsize, ecu->resp_id);
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void handle_pending_codes(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received request for pending trouble codes\n");
+  send_dtcs(can, 20, msg, ecu);
+}
+
+void handle_stored_codes(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received request for stored trouble codes\n");
+  send_dtcs(can, 2, msg, ecu);
+}
+
+// TODO: This is wrong.  Record a real transaction to see the format
+void handle_freeze_frame(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received request for freeze frame code\n");
+  //send_dtcs(can, 1, frame);
+  char resp[4];
+  resp[0] = msg->data[1] + 0x40;
+  resp[1] = 0x01;
+  resp[2] = 0x01;
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+void handle_perm_codes(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received request for permanent trouble codes\n");
+  send_dtcs(can, 0, msg, ecu);
+}
+
+void handle_dsc(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  //if(verbose) plog("Received DSC Request\n");
+  //send_error_snfs(can, frame);
+  if(verbose) plog("Received DSC Request giving VCDS respose\n");
+      frame.can_id = 0x77A;
+      frame.len = 8;
+      frame.data[0] = 0x06;
+      frame.data[1] = 0x50;
+      frame.data[2] = 0x03;
+      frame.data[3] = 0x00;
+      frame.data[4] = 0x32;
+      frame.data[5] = 0x01;
+      frame.data[6] = 0xF4;
+      frame.data[7] = 0xAA;
+      can_send(can, &frame);
+}
+
+/*
+ * Data identifiers.  Every module can have a table of DIDs, filled with the
+ * built in values in register_ecus() and from -P profiles.  The records are
+ * kept sorted so a lookup is a binary search, and the values live in one
+ * arena per module with room for as much as a write may store.
+ */
+struct did_table *did_table(struct ecu *ecu) {
+  if(!ecu->dids) ecu->dids = calloc(1, sizeof(struct did_table));
+  if(!ecu->dids) perror("did_table");
+  return ecu->dids;
+}
+
+// Adds a DID, replacing any earlier one.  max is the largest write, 0 for len
+int did_add(struct ecu *ecu, int did, unsigned char *data, int len, int flags, int max) {
+  struct did_table *t = did_table(ecu);
+  struct did_rec *r;
+  unsigned char *buf;
+  uint32_t size;
+  if(!t) return -1;
+  if(max < len) max = len;
+  if(t->count == t->size) {
+    size = t->size ? t->size * 2 : 64;
+    r = realloc(t->recs, size * sizeof(struct did_rec));
+    if(!r) {
+      perror("did_add");
+      return -1;
+    }
+    t->recs = r;
+    t->size = size;
+  }
+  if(t->data_len + max > t->data_size) {
+    size = t->data_size ? t->data_size * 2 : 4096;
+    while(size < t->data_len + max) size *= 2;
+    buf = realloc(t->data, size);
+    if(!buf) {
+      perror("did_add");
+      return -1;
+    }
+    t->data = buf;
+    t->data_size = size;
+  }
+  r = &t->recs[t->count++];
+  r->did = did;
+  r->flags = flags;
+  r->len = len;
+  r->max = max;
+  r->offset = t->data_len;
+  memcpy(&t->data[t->data_len], data, len);
+  t->data_len += max;
+  t->sorted = 0;
+  return 0;
+}
+
+int did_cmp(const void *a, const void *b) {
+  const struct did_rec *x = a, *y = b;
+  if(x->did != y->did) return x->did - y->did;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Sorts by DID.  A DID that was added again keeps only its last value
+void did_sort(struct did_table *t) {
+  int i, n = 0;
+  qsort(t->recs, t->count, sizeof(struct did_rec), did_cmp);
+  for(i = 0; i < t->count; i++) {
+    if(n && t->recs[n - 1].did == t->recs[i].did) n--;
+    t->recs[n++] = t->recs[i];
+  }
+  t->count = n;
+  t->sorted = 1;
+}
+
+struct did_rec *did_lookup(struct ecu *ecu, int did) {
+  struct did_table *t = ecu->dids;
+  int lo = 0, hi, mid;
+  if(!t) return NULL;
+  if(!t->sorted) did_sort(t);
+  hi = t->count - 1;
+  while(lo <= hi) {
+    mid = (lo + hi) / 2;
+    if(t->recs[mid].did == did) return &t->recs[mid];
+    if(t->recs[mid].did < did) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return NULL;
+}
+
+/*
+ * Read Data by ID.  Any number of DIDs in one request, answered together in
+ * the order they were asked for.  DIDs the module doesn't have are left out,
+ * and only if none are left is the answer RequestOutOfRange
+ */
+void handle_read_data_by_id(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  static unsigned char resp[ISOTP_FF_DL_MAX];
+  struct did_rec *r;
+  int len = msg_payload_len(msg);
+  int i, did, size = 1;
+  if(verbose) plog("Received Read Data by ID, %d DIDs\n", (len - 1) / 2);
+  if(len < 3 || (len - 1) % 2) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  resp[0] = msg->data[1] + 0x40;
+  for(i = 2; i < len; i += 2) {
+    did = (msg->data[i] << 8) | msg->data[i + 1];
+    r = did_lookup(ecu, did);
+    if(!r) {
+      if(verbose) plog(" + %04X not supported\n", did);
+      continue;
+    }
+    if(size + 2 + r->len > sizeof(resp)) {
+      send_error_nrc(can, msg, ecu, 0x14); // ResponseTooLong
+      return;
+    }
+    resp[size++] = did >> 8;
+    resp[size++] = did & 0xFF;
+    memcpy(&resp[size], &ecu->dids->data[r->offset], r->len);
+    size += r->len;
+    if(verbose) plog(" + %04X, %d bytes\n", did, r->len);
+  }
+  if(size == 1) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  isotp_send_to(can, ecu, (char *)resp, size, ecu->resp_id);
+}
+
+/*
+ * Write Data by ID.  Only DIDs marked rw take writes, and unless a max length
+ * was given the new value must be the same length as the old one
+ */
+void handle_write_data_by_id(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct did_rec *r;
+  struct uds_msg read;
+  unsigned char read_req[4];
+  char resp[4];
+  int len = msg_payload_len(msg) - 3;
+  int did;
+  if(len < 1) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  did = (msg->data[2] << 8) | msg->data[3];
+  if(verbose) plog("Received Write Data by ID %04X, %d bytes\n", did, len);
+  r = did_lookup(ecu, did);
+  if(!r || !(r->flags & DID_WRITABLE)) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  if((r->flags & DID_VARIABLE) ? len > r->max : len != r->len) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  r->len = len;
+  memcpy(&ecu->dids->data[r->offset], &msg->data[4], len);
+  r->flags |= DID_WRITTEN;
+  did_writes++;
+  did_dirty = 1;
+  // A cached read of this DID is stale now
+  read_req[0] = 3;
+  read_req[1] = UDS_SID_READ_DATA_BY_ID;
+  read_req[2] = msg->data[2];
+  read_req[3] = msg->data[3];
+  read.can_id = msg->can_id;
+  read.len = 4;
+  read.data = read_req;
+  resp_cache_drop(ecu, &read);
+  resp[0] = msg->data[1] + 0x40;
+  resp[1] = msg->data[2];
+  resp[2] = msg->data[3];
+  isotp_send_to(can, ecu, resp, 3, ecu->resp_id);
+}
+
+/*
+ * Memory images.  -I maps a file at an address for a module, privately
+ * (copy on write, writes are lost at exit) or shared with the file.  Reads
+ * go from the mapping straight into the consecutive frames.
+ */
+// addressAndLengthFormatIdentifier, address and size starting at p.  Returns
+// the bytes they take, -1 if the format is one we can't take
+int mem_parse_addr(unsigned char *p, int len, uint64_t *addr, uint64_t *size) {
+  int na = p[0] & 0x0F, ns = p[0] >> 4;
+  int i;
+  if(na == 0 || na > 8 || ns == 0 || ns > 8) return -1;
+  if(len < 1 + na + ns) return 1 + na + ns;
+  *addr = *size = 0;
+  for(i = 1; i <= na; i++) *addr = *addr << 8 | p[i];
+  for(; i <= na + ns; i++) *size = *size << 8 | p[i];
+  return 1 + na + ns;
+}
+
+// The region holding all of addr to addr + size, NULL if there isn't one
+struct mem_region *mem_lookup(struct ecu *ecu, uint64_t addr, uint64_t size) {
+  struct mem_region *r;
+  int i;
+  for(i = 0; i < ecu->nmem; i++) {
+    r = &ecu->mem[i];
+    if(addr >= r->base && size <= r->size && addr - r->base <= r->size - size) return r;
+  }
+  return NULL;
+}
+
+void handle_read_mem_by_address(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct mem_region *r;
+  unsigned char sid = msg->data[1] + 0x40;
+  uint64_t addr, size;
+  int len = msg_payload_len(msg);
+  int n = len < 2 ? 0 : mem_parse_addr(&msg->data[2], len - 1, &addr, &size);
+  if(n < 0) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  if(n == 0 || len != n + 1) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  if(verbose) plog("Received Read Memory by Address %llX, %llu bytes\n", (unsigned long long)addr, (unsigned long long)size);
+  r = mem_lookup(ecu, addr, size);
+  if(!r || size == 0 || size > ISOTP_MAX_PDU - 1) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  mem_reads++;
+  mem_read_bytes += size;
+  isotp_send_ref(can, ecu, &sid, 1, &r->data[addr - r->base], size, ecu->resp_id);
+}
+
+// The reply echoes the address and size
+void handle_write_mem_by_address(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct mem_region *r;
+  char resp[20];
+  uint64_t addr, size;
+  int len = msg_payload_len(msg);
+  int n = len < 2 ? 0 : mem_parse_addr(&msg->data[2], len - 1, &addr, &size);
+  if(n < 0) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  if(n == 0 || len < n + 2 || (uint64_t)(len - n - 1) != size) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  if(verbose) plog("Received Write Memory by Address %llX, %llu bytes\n", (unsigned long long)addr, (unsigned long long)size);
+  r = mem_lookup(ecu, addr, size);
+  if(!r) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  memcpy(&r->data[addr - r->base], &msg->data[n + 2], size);
+  mem_writes++;
+  resp[0] = msg->data[1] + 0x40;
+  memcpy(&resp[1], &msg->data[2], n);
+  isotp_send_to(can, ecu, resp, n + 1, ecu->resp_id);
+}
+
+/*
+ * Downloads (0x34, 0x36, 0x37).  RequestDownload offers the tester blocks of
+ * up to xfer_block_max bytes and every TransferData block goes straight to
+ * where it belongs: into the image when the address is in one, otherwise a
+ * file in the download directory (-D), or nowhere when there isn't one.
+ * Nothing is buffered beyond the ISO-TP message the block came in.
+ *
+ * Uploads (0x35, 0x36, 0x37) only come from images and every block is sent
+ * from the mapping by isotp_send_ref(), unless it is fuzzed.
+ */
+char *xfer_names[XFER_TYPES] = { "", "download", "upload" };
+
+struct xfer *xfer_get(struct ecu *ecu) {
+  if(!ecu->xfer) ecu->xfer = calloc(1, sizeof(struct xfer));
+  if(!ecu->xfer) perror("xfer_get");
+  return ecu->xfer;
+}
+
+// Throughput of the finished transfers and the one in progress
+double xfer_rate(int type) {
+  struct xfer_stats *st = &xfer_stats[type];
+  unsigned long long bytes = st->bytes;
+  uint64_t us = st->busy_us;
+  if(xfer_cur[type]) us += xfer_cur[type]->last_us - xfer_cur[type]->start_us;
+  return us ? bytes * 1000000.0 / us : 0;
+}
+
+void xfer_end(struct ecu *ecu, struct xfer *x, int aborted) {
+  struct xfer_stats *st = &xfer_stats[x->type];
+  uint64_t us = x->last_us - x->start_us;
+  if(x->fd >= 0) close(x->fd);
+  x->fd = -1;
+  st->busy_us += us;
+  if(aborted) st->aborted++;
+  plog("%s: %s of %llu/%llu bytes at %llX %s, %.3fs, %.0f bytes/s\n", ecu->name, xfer_names[x->type],
+       (unsigned long long)x->done, (unsigned long long)x->size, (unsigned long long)x->addr,
+       aborted ? "abandoned" : "done", us / 1000000.0, us ? x->done * 1000000.0 / us : 0);
+  xfer_cur[x->type] = NULL;
+  x->type = 0;
+}
+
+// Answers 0x74/0x75 with maxNumberOfBlockLength
+void xfer_accept(struct transport *can, struct uds_msg *msg, struct ecu *ecu, struct xfer *x) {
+  char resp[8];
+  resp[0] = msg->data[1] + 0x40;
+  resp[1] = 0x20; // lengthFormatIdentifier, 2 byte length
+  resp[2] = x->max_block >> 8;
+  resp[3] = x->max_block & 0xFF;
+  xfer_stats[x->type].sessions++;
+  xfer_cur[x->type] = x;
+  isotp_send_to(can, ecu, resp, 4, ecu->resp_id);
+}
+
+// Checks a 0x34/0x35 request.  Returns the address and size, or -1 after an NRC
+int xfer_request(struct transport *can, struct uds_msg *msg, struct ecu *ecu, uint64_t *addr, uint64_t *size) {
+  struct xfer *x = ecu->xfer;
+  int len = msg_payload_len(msg);
+  int n = len < 3 ? 0 : mem_parse_addr(&msg->data[3], len - 2, addr, size);
+  if(n < 0) {
+    send_error_roor(can, msg, ecu);
+    return -1;
+  }
+  if(n == 0 || len != n + 2) {
+    send_error_imlf(can, msg, ecu);
+    return -1;
+  }
+  if(x && x->type) {
+    if(now_us() - x->last_us < XFER_IDLE_MS * 1000) {
+      send_error_nrc(can, msg, ecu, 0x22); // ConditionsNotCorrect
+      return -1;
+    }
+    xfer_end(ecu, x, 1);
+  }
+  if(*size == 0) {
+    send_error_roor(can, msg, ecu);
+    return -1;
+  }
+  return 0;
+}
+
+void handle_request_download(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct mem_region *r;
+  struct xfer *x;
+  char path[512];
+  uint64_t addr, size;
+  int fd = -1;
+  if(xfer_request(can, msg, ecu, &addr, &size) < 0) return;
+  if(verbose) plog("Received Request Download %llX, %llu bytes, format %02X\n", (unsigned long long)addr,
+                   (unsigned long long)size, msg->data[2]);
+  r = mem_lookup(ecu, addr, size);
+  if(!r && mem_lookup(ecu, addr, 1)) { // Starts in an image but doesn't fit
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  if(!r && xfer_dir) {
+    snprintf(path, sizeof(path), "%s/download-%03X-%llX.bin", xfer_dir, ecu->req_id, (unsigned long long)addr);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      perror(path);
+      send_error_nrc(can, msg, ecu, 0x70); // UploadDownloadNotAccepted
+      return;
+    }
+  }
+  x = xfer_get(ecu);
+  if(!x) {
+    if(fd >= 0) close(fd);
+    send_error_nrc(can, msg, ecu, 0x70);
+    return;
+  }
+  x->type = XFER_DOWNLOAD;
+  x->addr = addr;
+  x->size = size;
+  x->done = 0;
+  x->blocks = 0;
+  x->bsc = 1;
+  x->max_block = xfer_block_max;
+  x->mem = r ? &r->data[addr - r->base] : NULL;
+  x->fd = fd;
+  x->start_us = x->last_us = now_us();
+  xfer_accept(can, msg, ecu, x);
+}
+
+void handle_request_upload(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct mem_region *r;
+  struct xfer *x;
+  uint64_t addr, size;
+  if(xfer_request(can, msg, ecu, &addr, &size) < 0) return;
+  if(verbose) plog("Received Request Upload %llX, %llu bytes, format %02X\n", (unsigned long long)addr,
+                   (unsigned long long)size, msg->data[2]);
+  r = mem_lookup(ecu, addr, size);
+  if(!r) {
+    send_error_roor(can, msg, ecu);
+    return;
+  }
+  x = xfer_get(ecu);
+  if(!x) {
+    send_error_nrc(can, msg, ecu, 0x70);
+    return;
+  }
+  x->type = XFER_UPLOAD;
+  x->addr = addr;
+  x->size = size;
+  x->done = 0;
+  x->blocks = 0;
+  x->bsc = 1;
+  x->max_block = xfer_block_max;
+  x->mem = &r->data[addr - r->base];
+  x->fd = -1;
+  x->block_off = 0;
+  x->block_len = 0;
+  x->block_fuzzed = 0;
+  x->start_us = x->last_us = now_us();
+  xfer_accept(can, msg, ecu, x);
+}
+
+// Fuzzed blocks are a copy of the image with a few bytes changed, the more
+// the higher the fuzz level.  The copy is the transfer's own, so it stays put
+// while the block is sent and a repeated request gets the same bytes again
+int xfer_fuzz_block(struct xfer *x) {
+  unsigned char *buf;
+  int i, n;
+  if(x->block_len > x->fuzz_size) {
+    buf = realloc(x->fuzz_buf, x->block_len);
+    if(!buf) {
+      perror("xfer_fuzz_block");
+      return -1;
+    }
+    x->fuzz_buf = buf;
+    x->fuzz_size = x->block_len;
+  }
+  fuzz_begin("upload block");
+  memcpy(x->fuzz_buf, &x->mem[x->block_off], x->block_len);
+  n = 1 + fuzz_rand(fuzz_level * 4);
+  for(i = 0; i < n; i++) x->fuzz_buf[fuzz_rand(x->block_len)] = fuzz_rand(256);
+  return 0;
+}
+
+// Sends the last upload block, straight from the image unless it was fuzzed
+void xfer_send_block(struct transport *can, struct ecu *ecu, struct xfer *x, int bsc) {
+  unsigned char hdr[2];
+  hdr[0] = UDS_SID_TRANSFER_DATA + 0x40;
+  hdr[1] = bsc;
+  isotp_send_ref(can, ecu, hdr, 2, x->block_fuzzed ? x->fuzz_buf : &x->mem[x->block_off], x->block_len, ecu->resp_id);
+}
+
+// 0x36 during an upload asks for the next block
+void xfer_upload_block(struct transport *can, struct uds_msg *msg, struct ecu *ecu, struct xfer *x) {
+  int bsc = msg->data[2];
+  if(x->blocks && bsc == ((x->bsc - 1) & 0xFF)) { // Our block was lost, send it again
+    if(verbose) plog("Repeated block %02X\n", bsc);
+    xfer_send_block(can, ecu, x, bsc);
+    return;
+  }
+  if(bsc != x->bsc) {
+    if(verbose) plog("Block %02X out of sequence, expected %02X\n", bsc, x->bsc);
+    send_error_nrc(can, msg, ecu, 0x73);
+    return;
+  }
+  if(x->done == x->size) { // Everything has been sent, RequestTransferExit is next
+    send_error_nrc(can, msg, ecu, 0x24);
+    return;
+  }
+  x->block_off = x->done;
+  x->block_len = x->max_block - 2;
+  if(x->block_len > x->size - x->done) x->block_len = x->size - x->done;
+  x->block_fuzzed = fuzz_level && xfer_fuzz_block(x) == 0;
+  x->done += x->block_len;
+  x->blocks++;
+  x->bsc = (x->bsc + 1) & 0xFF;
+  x->last_us = now_us();
+  xfer_stats[x->type].blocks++;
+  xfer_stats[x->type].bytes += x->block_len;
+  xfer_send_block(can, ecu, x, bsc);
+}
+
+// Puts a downloaded block where it goes.  Returns -1 if it can't be written
+int xfer_write(struct xfer *x, unsigned char *data, int len) {
+  ssize_t n;
+  int done = 0;
+  if(x->mem) {
+    memcpy(&x->mem[x->done], data, len);
+    return 0;
+  }
+  while(x->fd >= 0 && done < len) {
+    n = pwrite(x->fd, data + done, len - done, x->done + done);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) {
+      perror("xfer_write");
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+void handle_transfer_data(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct xfer *x = ecu->xfer;
+  char resp[4];
+  int len = msg_payload_len(msg) - 2;
+  int bsc = msg->data[2];
+  if(!x || !x->type || len < 0) {
+    if(len < 0) send_error_imlf(can, msg, ecu);
+    else send_error_nrc(can, msg, ecu, 0x24); // RequestSequenceError
+    return;
+  }
+  if(x->type == XFER_UPLOAD) {
+    xfer_upload_block(can, msg, ecu, x);
+    return;
+  }
+  if(len < 1 || len + 2 > x->max_block) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  resp[0] = msg->data[1] + 0x40;
+  resp[1] = bsc;
+  if(x->blocks && bsc == ((x->bsc - 1) & 0xFF)) { // Our answer was lost, the block is already written
+    if(verbose) plog("Repeated block %02X\n", bsc);
+    isotp_send_to(can, ecu, resp, 2, ecu->resp_id);
+    return;
+  }
+  if(bsc != x->bsc) {
+    if(verbose) plog("Block %02X out of sequence, expected %02X\n", bsc, x->bsc);
+    send_error_nrc(can, msg, ecu, 0x73); // WrongBlockSequenceCounter
+    return;
+  }
+  if(len > x->size - x->done) {
+    send_error_nrc(can, msg, ecu, 0x71); // TransferDataSuspended
+    return;
+  }
+  if(xfer_write(x, &msg->data[3], len) < 0) {
+    send_error_nrc(can, msg, ecu, 0x72); // GeneralProgrammingFailure
+    return;
+  }
+  x->done += len;
+  x->blocks++;
+  x->bsc = (x->bsc + 1) & 0xFF; // 0xFF wraps to 0x00
+  x->last_us = now_us();
+  xfer_stats[x->type].blocks++;
+  xfer_stats[x->type].bytes += len;
+  isotp_send_to(can, ecu, resp, 2, ecu->resp_id);
+}
+
+void handle_request_transfer_exit(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct xfer *x = ecu->xfer;
+  char resp[2];
+  if(!x || !x->type || x->done < x->size) {
+    send_error_nrc(can, msg, ecu, 0x24);
+    return;
+  }
+  xfer_end(ecu, x, 0);
+  resp[0] = msg->data[1] + 0x40;
+  isotp_send_to(can, ecu, resp, 1, ecu->resp_id);
+}
+
+/*
+ * UDS Read Data by Periodic ID.  Each periodic DID (the low byte of 0xF2xx)
+ * goes out as a single frame on our reply ID with the DID in the first byte
+ */
+void handle_read_periodic_data(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[4];
+  long period_ms = 0;
+  int len = msg_payload_len(msg);
+  int i;
+  if(verbose) plog("Received Read Data by Periodic ID\n");
+  if(len < 2 || (len < 3 && msg->data[2] != UDS_PERIODIC_STOP)) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  switch(msg->data[2]) {
+    case UDS_PERIODIC_SLOW:
+      period_ms = PERIODIC_SLOW_MS;
+      break;
+    case UDS_PERIODIC_MEDIUM:
+      period_ms = PERIODIC_MEDIUM_MS;
+      break;
+    case UDS_PERIODIC_FAST:
+      period_ms = PERIODIC_FAST_MS;
+      break;
+    case UDS_PERIODIC_STOP:
+      if(verbose) plog(" + Stop\n");
+      if(len == 2) periodic_stop(ecu, -1);
+      break;
+    default:
+      send_error_roor(can, msg, ecu);
+      return;
+  }
+  for(i = 3; i <= len; i++) {
+    if(verbose) plog(" + %s F2%02X\n", period_ms ? "Send" : "Stop", msg->data[i]);
+    if(!period_ms) periodic_stop(ecu, msg->data[i]);
+    else if(periodic_add(ecu, PERIODIC_UDS, ecu->resp_id, msg->data[i], period_ms * 1000) < 0) break;
+  }
+  resp[0] = msg->data[1] + 0x40;
+  isotp_send_to(can, ecu, resp, 1, ecu->resp_id);
+}
+
+/*
+ GM
+*/
+
+// Read DID from ID (GM)
+// For now we are only setting this up to work with the BCM
+// 244   [3]  02 1A 90
+void handle_gm_read_did_by_id(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose) plog("Received GM Read DID by ID Request\n");
+  char resp[300];
+  char *tracenum = "874602RA51950204";
+  int pktsize;
+  switch(msg->data[2]) {
+    case 0x90:  // VIN
+      if(verbose) plog(" + Requested VIN\n");
+      switch(fuzz_level) {
+        case 0:
+          if(verbose) plog("Sending VIN %s\n", vin);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          memcpy(&resp[2], vin, strlen(vin));
+          isotp_send_to(can, ecu, resp, 3 + strlen(vin), ecu->resp_id);
+          break;
+        case 1:
+          fuzz_begin("VIN with printable chars");
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          gen_data(DATA_ALPHANUM, (unsigned char *)&resp[2], 17);
+          resp[2 + 8] = calc_vin_checksum(&resp[2], 17);
+          if(verbose) plog("Using VIN: %.17s\n", &resp[2]);
+          isotp_send_to(can, ecu, resp, 3 + 17, ecu->resp_id);
+          break;
+        case 2:
+        case 3:  // At 3 the ISOTP spec gets flaky
+          fuzz_begin("big VIN with printable chars");
+          pktsize = fuzz_rand(252);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          gen_data(DATA_ALPHANUM, (unsigned char *)&resp[2], pktsize);
+          resp[2 + 8] = calc_vin_checksum(&resp[2], pktsize);
+          if(verbose) plog("Using big VIN (%d chars): %.*s\n", pktsize, pktsize, &resp[2]);
+          isotp_send_to(can, ecu, resp, 3 + pktsize, ecu->resp_id);
+          break;
+        case 4:
+          fuzz_begin("VIN with binary data");
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          gen_data(DATA_BINARY, (unsigned char *)&resp[2], 17);
+          resp[2 + 8] = calc_vin_checksum(&resp[2], 17);
+          if(verbose) print_bin((unsigned char *)&resp[2], 17);
+          isotp_send_to(can, ecu, resp, 3 + 17, ecu->resp_id);
+          break;
+        case 5:
+        default:
+          fuzz_begin("VIN with binary data and size");
+          pktsize = fuzz_rand(252);
+          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          gen_data(DATA_BINARY, (unsigned char *)&resp[2], pktsize);
+          if(verbose) print_bin((unsigned char *)&resp[2], pktsize);
+          isotp_send_to(can, ecu, resp, 3 + pktsize, ecu->resp_id);
+          break;
+       }
+      break;
+    case 0xA1:  // SDM Primary Key
+      if(verbose) plog(" + Requested SDM Primary Key\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending SDM Key %04X\n", 0x6966);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 0x69;
+          resp[3] = 0x66;
+          isotp_send_to(can, ecu, resp, 5, ecu->resp_id);
+          break;
+      }
+      break;
+    case 0xB4:  // Traceability Number
+      if(verbose) plog(" + Requested Traceability Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending Traceabiliity number %s\n", tracenum);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          memcpy(&resp[2], tracenum, strlen(tracenum));
+          isotp_send_to(can, ecu, resp, 3 + strlen(tracenum), ecu->resp_id);
+          break;
+      }
+      break;
+    case 0xB7:  // Software Number
+      if(verbose) plog(" + Requested Software Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending SW # %d\n", 600);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 0x42;
+          resp[3] = 0xAA;
+          resp[4] = 6;
+          resp[5] = 2; // 600
+          resp[6] = 0x58;
+          isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+          break;
+      }
+      break;
+    case 0xCB:  // End Model Part #
+      if(verbose) plog(" + Requested End Model Part Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending End Model Part Number %d\n", 15804602);
+          resp[0] = msg->data[1] + 0x40;
+          resp[1] = msg->data[2];
+          resp[2] = 0x00;
+          resp[3] = 0xF1;
+          resp[4] = 0x28;
+          resp[5] = 0xBA;
+          isotp_send_to(can, ecu, resp, 6, ecu->resp_id);
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Every DPID in a GM 0xAA request becomes its own stream
+void gm_start_periodic(struct uds_msg *msg, struct ecu *ecu, int offset, canid_t can_id, long period_ms) {
+  int i;
+  for(i = 3 + offset; i < msg->data[offset] + 1 + offset && i < msg->len && i < 3 + offset + GM_MAX_DPIDS; i++) {
+    periodic_add(ecu, PERIODIC_GM, can_id, msg->data[i], period_ms * 1000);
+  }
+}
+
+/* GM Read Data via PID */
+/* 244   [5]  04 AA 03 02 07 */
+/* 544#0738408D8B000200 */
+/* 544#02508D8D00000000 */
+void handle_gm_read_data_by_id(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  if(verbose) plog("Received GM Read Data by ID Request\n");
+  struct tx_job *job;
+  int offset = 0;
+  int i, end;
+  if (msg->data[0] == 0xFE) offset = 1;
+  if(msg->can_id == 0x7e0) {
+    frame.can_id = 0x5e8;
+  } else {
+    frame.can_id = 0x500 + (msg->can_id & 0xFF);
+  }
+  frame.len = 8;
+  // A CAN FD single frame can list far more DPIDs than a request may have
+  end = msg->data[offset] + 1 + offset;
+  if(end > msg->len) end = msg->len;
+  if(msg->data[2 + offset] >= 0x01 && msg->data[2 + offset] <= 0x04 && end - (3 + offset) > GM_MAX_DPIDS) {
+    send_error_imlf(can, msg, ecu);
+    return;
+  }
+  switch(msg->data[2 + offset]) { // Subfunctions
+    case 0x00:  // Stop
+      if(verbose) plog(" + Stop Data Request\n");
+      memset(frame.data, 0, 8);
+      can_send(can, &frame);
+      if(msg->data[offset] < 3) periodic_stop(ecu, -1); // No DPIDs listed, stop them all
+      for(i = 3 + offset; i < msg->data[offset] + 1 + offset && i < msg->len; i++) periodic_stop(ecu, msg->data[i]);
+      job_cancel(ecu, UDS_SID_GM_READ_DATA_BY_ID);
+      break;
+    case 0x01:  // One Response
+      if(verbose) plog(" + One Response\n");
+      job = job_start(ecu, UDS_SID_GM_READ_DATA_BY_ID, JOB_GM_DATA, &frame, GM_DATA_GAP_MS * 1000, GM_DATA_GAP_MS * 1000);
+      if(!job) break;
+      for(i = 3 + offset; i < msg->data[offset] + 1 + offset && i < msg->len && job->ndpids < GM_MAX_DPIDS; i++) job->dpids[job->ndpids++] = msg->data[i];
+      job->left = job->ndpids;
+      fuzz_begin("GM data one response");
+      job->rng = fuzz_rng;
+      if(!job->ndpids) {
+        job_free(job);
+        break;
+      }
+      // First frame now, the rest every GM_DATA_GAP_MS
+      if(!job_next(job, &frame)) job_free(job);
+      can_send(can, &frame);
+      break;
+    case 0x02:  // Slow Rate
+      if(verbose) plog(" + Slow Rate\n");
+      gm_start_periodic(msg, ecu, offset, frame.can_id, PERIODIC_SLOW_MS);
+      break;
+    case 0x03:  // Medium Rate
+      if(verbose) plog(" + Medium Rate\n");
+      gm_start_periodic(msg, ecu, offset, frame.can_id, PERIODIC_MEDIUM_MS);
+      break;
+    case 0x04:  // Fast Rate
+      if(verbose) plog(" + Fast Rate\n");
+      gm_start_periodic(msg, ecu, offset, frame.can_id, PERIODIC_FAST_MS);
+      break;
+    default:
+      plog("Unknown subfunction timer\n");
+      break;
+  }
+}
+
+// GM ReturnToNormalMode ends the diagnostic session, so everything we were streaming stops
+void handle_gm_return_to_normal(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  char resp[2];
+  if(verbose) plog("Received GM Return To Normal Mode\n");
+  job_cancel(ecu, -1);
+  periodic_stop(ecu, -1);
+  resp[0] = msg->data[1] + 0x40;
+  isotp_send_to(can, ecu, resp, 1, ecu->resp_id);
+}
+
+/* GM Diag format is either
+     101#FE 03 A9 81 52  (Functional addressing: Where FE is the extended address)
+     7E0#03 A9 81 52 (no extended addressing)
+*/
+void handle_gm_read_diag(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  if(verbose) plog("Received GM Read Diagnostic Request\n");
+  struct tx_job *job;
+  int offset = 0;
+  if(msg->data[0] == 0xFE) offset = 1;
+  switch(msg->data[2 + offset]) { // Subfunctions
+    case UDS_READ_STATUS_BY_MASK:  // Read DTCs by mask
+      if(verbose) {
+        plog(" + Read DTCs by mask\n");
+        if(msg->data[3 + offset] & DTC_SUPPORTED_BY_CALIBRATION) plog("   - Supported By Calibration\n");
+        if(msg->data[3 + offset] & DTC_CURRENT_DTC) plog("   - Current DTC\n");
+        if(msg->data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_CLEARED) plog("   - Tests not passed since DTC cleared\n");
+        if(msg->data[3 + offset] & DTC_TEST_FAILED_SINCE_CLEARED) plog("   - Tests failed since DTC cleared\n");
+        if(msg->data[3 + offset] & DTC_HISTORY) plog("   - DTC History\n");
+        if(msg->data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_POWER) plog("   - Tests not passed since power up\n");
+        if(msg->data[3 + offset] & DTC_CURRENT_DTC_SINCE_POWER) plog("   - Tests failed since power up\n");
+        if(msg->data[3 + offset] & DTC_WARNING_INDICATOR_STATE) plog("   - Warning Indicator State\n");
+      }
+      if(msg->can_id == 0x7e0) {
+        frame.can_id = 0x5e8;
+      } else {
+        frame.can_id = 0x500 + (msg->can_id & 0xFF);
+      }
+      frame.len = 8;
+      frame.data[0] = msg->data[2 + offset];
+      frame.data[1] = 0;    // DTC 1st byte
+      frame.data[2] = 0x30; // DTC 2nd byte
+      frame.data[3] = 0;
+      frame.data[4] = 0x6F; // Last Test/ This Ignition/ Last Clear bitflag
+      frame.data[5] = 0;
+      frame.data[6] = 0;
+      frame.data[7] = 0;
+      can_send(can, &frame);
+      // The rest comes from the main loop, GM_DTC_FIRST_MS from now instead of waiting for a FC
+      job = job_start(ecu, UDS_SID_GM_READ_DIAG_INFO, JOB_GM_DTC, &frame, GM_DTC_FIRST_MS * 1000, GM_DTC_GAP_MS * 1000);
+      if(job && fuzz_level == 1) {
+        fuzz_begin("GM DTCs by mask");
+        job->left = fuzz_rand(1024);
+        job->rng = fuzz_rng;
+        if(verbose) plog("Sending %d DTCs\n", job->left);
+      }
+      break;
+    default:
+      if(verbose) plog(" + Unknown subfunction request %02X\n", msg->data[2 + offset]);
+      break;
+  }
+}
+
+/*
+  Gateway
+*/
+//Pkt: 710#02 10 03 55 55 55 55 55 
+void handle_vcds_dsc(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  if(verbose) plog("Received VCDS 0x710 gateway request\n");
+  frame.can_id = ecu->resp_id;
+  frame.len = 8;
+  frame.data[0] = 0x06;
+  frame.data[1] = 0x50;
+  frame.data[2] = 0x03;
+  frame.data[3] = 0x00;
+  frame.data[4] = 0x32;
+  frame.data[5] = 0x01;
+  frame.data[6] = 0xF4;
+  frame.data[7] = 0xAA;
+  can_send(can, &frame);
+}
+
+void handle_vcds_read_data_by_id(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  if(verbose) plog("Received VCDS 0x710 gateway request\n");
+  char resp[150];
+  if(msg->data[2] == 0xF1) {
+    switch(msg->data[3]) {
+      case 0x87: // VAG Number
+        if(verbose) plog("Read data by ID 0x87\n");
+        resp[0] = msg->data[1] + 0x40;
+        resp[1] = msg->data[2];
+        resp[2] = 0x87;
+        resp[3] = 0x35;
+        resp[4] = 0x51;
+        resp[5] = 0x45;
+        resp[6] = 0x39;
+        resp[7] = 0x30;
+        resp[8] = 0x37;
+        resp[9] = 0x35;
+        resp[10] = 0x33;
+        resp[11] = 0x30;
+        resp[12] = 0x43;
+        resp[13] = 0x20; // Note normally this would pad with AA's
+        isotp_send_to(can, ecu, resp, 14, ecu->resp_id);
+      break;
+      case 0x89: // VAG Number
+        if(verbose) plog("Read data by ID 0x89\n");
+        frame.can_id = ecu->resp_id;
+        frame.len = 8;
+        frame.data[0] = 0x07;
+        frame.data[1] = 0x62;
+        frame.data[2] = 0xF1;
+        frame.data[3] = 0x89;
+        frame.data[4] = 0x33; //3
+        frame.data[5] = 0x32; //2
+        frame.data[6] = 0x30; //0
+        frame.data[7] = 0x33; //3
+        can_send(can, &frame);
+      break;
+      case 0x91: // VAG Number
+        if(verbose) plog("Read data by ID 0x91\n");
+        resp[0] = msg->data[1] + 0x40;
+        resp[1] = msg->data[2];
+        resp[2] = 0x87;
+        resp[3] = 0x35;
+        resp[4] = 0x51;
+        resp[5] = 0x45;
+        resp[6] = 0x39;
+        resp[7] = 0x30;
+        resp[8] = 0x37;
+        resp[9] = 0x35;
+        resp[10] = 0x33;
+        resp[11] = 0x30;
+        resp[12] = 0x41;
+        resp[13] = 0x20; // Note normally this would pad with AA's
+        isotp_send_to(can, ecu, resp, 14, ecu->resp_id);
+      break;
+      default:
+        if(verbose) plog("NOTE: Read data by unknown ID %02X\n", msg->data[3]);
+        resp[0] = msg->data[1] + 0x40;
+        resp[1] = msg->data[2];
+        resp[2] = 0x87;
+        resp[3] = 0x35;
+        resp[4] = 0x51;
+        resp[5] = 0x45;
+        resp[6] = 0x39;
+        resp[7] = 0x30;
+        resp[8] = 0x37;
+        resp[9] = 0x35;
+        resp[10] = 0x33;
+        resp[11] = 0x30;
+        resp[12] = 0x41;
+        resp[13] = 0x20; // Note normally this would pad with AA's
+        isotp_send_to(can, ecu, resp, 14, ecu->resp_id);
+      break;
+     
+    }
+  } else {
+    if (verbose) plog("Unknown read data by Identifier %02X\n", msg->data[2]);
+  }
+}
+
+// return Mode/SIDs in english, "" if we don't know it
+char *sid_name(int sid) {
+  switch(sid) {
+    case OBD_MODE_SHOW_CURRENT_DATA:
+       return "Show current Data";
+       break;
+    case OBD_MODE_SHOW_FREEZE_FRAME:
+       return "Show freeze frame";
+       break;
+    case OBD_MODE_READ_DTC:
+       return "Read DTCs";
+       break;
+    case OBD_MODE_CLEAR_DTC:
+       return "Clear DTCs";
+       break;
+    case OBD_MODE_TEST_RESULTS_NON_CAN:
+       return "Mode Test Results (Non-CAN)";
+       break;
+    case OBD_MODE_TEST_RESULTS_CAN:
+       return "Mode Test Results (CAN)";
+       break;
+    case OBD_MODE_READ_PENDING_DTC:
+       return "Read Pending DTCs";
+       break;
+    case OBD_MODE_CONTROL_OPERATIONS:
+       return "Control Operations";
+       break;
+    case OBD_MODE_VEHICLE_INFORMATION:
+       return "Vehicle Information";
+       break;
+    case OBD_MODE_READ_PERM_DTC:
+       return "Read Permanent DTCs";
+       break;
+    case UDS_SID_DIAGNOSTIC_CONTROL:
+       return "Diagnostic Control";
+       break;
+    case UDS_SID_ECU_RESET:
+       return "ECU Reset";
+       break;
+    case UDS_SID_CLEAR_DTC:
+       return "UDS Clear DTCs";
+       break;
+    case UDS_SID_READ_DTC:
+       return "UDS Read DTCs";
+       break;
+    case UDS_SID_GM_READ_DID_BY_ID:
+       return "Read DID by ID (GM)";
+       break;
+    case UDS_SID_RESTART_COMMUNICATIONS:
+       return "Restore Normal Commnications";
+       break;
+    case UDS_SID_READ_DATA_BY_ID:
+       return "Read DATA By ID";
+       break;
+    case UDS_SID_READ_MEM_BY_ADDRESS:
+       return "Read Memory By Address";
+       break;
+    case UDS_SID_READ_SCALING_BY_ID:
+       return "Read Scalling Data by ID";
+       break;
+    case UDS_SID_SECURITY_ACCESS:
+       return "Security Access";
+       break;
+    case UDS_SID_COMMUNICATION_CONTROL:
+       return "Communication Control";
+       break;
+    case UDS_SID_READ_DATA_BY_ID_PERIODIC:
+       return "Read DATA By ID Periodically";
+       break;
+    case UDS_SID_DEFINE_DATA_ID:
+       return "Define DATA By ID";
+       break;
+    case UDS_SID_WRITE_DATA_BY_ID:
+       return "Write DATA By ID";
+       break;
+    case UDS_SID_IO_CONTROL_BY_ID:
+       return "Input/Output Control By ID";
+       break;
+    case UDS_SID_ROUTINE_CONTROL:
+       return "Routine Control";
+       break;
+    case UDS_SID_REQUEST_DOWNLOAD:
+       return "Request Download";
+       break;
+    case UDS_SID_REQUEST_UPLOAD:
+       return "Request Upload";
+       break;
+    case UDS_SID_TRANSFER_DATA:
+       return "Transfer DATA";
+       break;
+    case UDS_SID_REQUEST_XFER_EXIT:
+       return "Request Transfer Exit";
+       break;
+    case UDS_SID_REQUEST_XFER_FILE:
+       return "Request Transfer File";
+       break;
+    case UDS_SID_WRITE_MEM_BY_ADDRESS:
+       return "Write Memory By Address";
+       break;
+    case UDS_SID_TESTER_PRESENT:
+       return "Tester Present";
+       break;
+    case UDS_SID_ACCESS_TIMING:
+       return "Access Timing";
+       break;
+    case UDS_SID_SECURED_DATA_TRANS:
+       return "Secured DATA Transfer";
+       break;
+    case UDS_SID_CONTROL_DTC_SETTINGS:
+       return "Control DTC Settings";
+       break;
+    case UDS_SID_RESPONSE_ON_EVENT:
+       return "Response On Event";
+       break;
+    case UDS_SID_LINK_CONTROL:
+       return "Link Control";
+       break;
+    case UDS_SID_GM_PROGRAMMED_STATE:
+       return "Programmed State (GM)";
+       break;
+    case UDS_SID_GM_PROGRAMMING_MODE:
+       return "Programming Mode (GM)";
+       break;
+    case UDS_SID_GM_READ_DIAG_INFO:
+       return "Read Diagnostic Information (GM)";
+       break;
+    case UDS_SID_GM_READ_DATA_BY_ID:
+       return "Read DATA By ID (GM)";
+       break;
+    case UDS_SID_GM_DEVICE_CONTROL:
+       return "Device Control (GM)";
+       break;
+    default:
+       return "";
+  }
+}
+
+// Prints raw packet in ID#DATA format
+void print_pkt(struct canfd_frame frame) {
+  log_bytes(LOG_PKT, frame.can_id, frame.data, frame.len);
+}
+
+// Prints a request in the same format as print_pkt
+void print_msg(struct uds_msg *msg) {
+  log_bytes(LOG_PKT, msg->can_id, msg->data, msg->len);
+}
+
+// Prints binary data in hex format
+void print_bin(unsigned char *bin, int size) {
+  log_bytes(LOG_BIN, 0, bin, size);
+}
+
+void handle_tester_present(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  if(verbose > 1) plog("Received TesterPresent\n");
+  generic_OK_resp_to(can, msg, ecu);
+}
+
+/*
+ * ECU registry.  Every CAN ID we answer to points at the module that owns it,
+ * and each module has a flat table of SID handlers.  handle_pkt() just indexes
+ * into these so new modules never need a new switch statement.
+ */
+struct ecu *register_ecu(char *name, int req_id, int resp_id, int flags) {
+  struct ecu *ecu;
+  ecu = calloc(1, sizeof(struct ecu));
+  if(!ecu) {
+    perror("register_ecu");
+    exit(1);
+  }
+  ecu->name = name;
+  ecu->req_id = req_id;
+  ecu->resp_id = resp_id;
+  ecu->flags = flags;
+  ecu_by_id[req_id & CAN_SFF_MASK] = ecu;
+  filters_dirty = 1;
+  return ecu;
+}
+
+// Answer another arbitration ID (ex: functional 0x7DF) with an existing module
+void register_ecu_alias(struct ecu *ecu, int req_id) {
+  ecu_by_id[req_id & CAN_SFF_MASK] = ecu;
+  filters_dirty = 1;
+}
+
+/*
+ * Only have the kernel hand us frames for IDs we answer to.  Everything else
+ * on the bus (ICSim traffic, other modules) is dropped before it is copied
+ * to user space.  Called again whenever a module is registered.
+ */
+void update_can_filters(struct transport *can) {
+  static struct can_filter filters[MAX_CAN_ID];
+  int i, count = 0;
+  filters_dirty = 0;
+  if(no_filters || !can->set_filters) return;
+  for(i = 0; i < MAX_CAN_ID; i++) {
+    if(!ecu_by_id[i]) continue;
+    filters[count].can_id = i;
+    filters[count].can_mask = CAN_EFF_FLAG | CAN_SFF_MASK; // Matches RTRs too
+    count++;
+  }
+  if(count > CAN_RAW_FILTER_MAX) {
+    if(verbose) plog("Too many IDs for CAN filters (%d), receiving everything\n", count);
+    filters[0].can_id = 0;
+    filters[0].can_mask = 0;
+    count = 1;
+  }
+  if(can->set_filters(can, filters, count) < 0) {
+    perror("CAN_RAW_FILTER");
+    return;
+  }
+  if(verbose > 1) plog("Installed %d CAN filters\n", count);
+}
+
+// Use subfunc ANY_SUBFUNC to handle every sub-function of a SID
+void register_handler(struct ecu *ecu, int sid, int subfunc, uds_handler handler) {
+  struct sid_entry *entry = &ecu->sids[sid & 0xFF];
+  if(subfunc == ANY_SUBFUNC) {
+    entry->handler = handler;
+    return;
+  }
+  if(!entry->subfuncs) {
+    entry->subfuncs = calloc(256, sizeof(struct sid_entry));
+    if(!entry->subfuncs) {
+      perror("register_handler");
+      exit(1);
+    }
+  }
+  entry->subfuncs[subfunc & 0xFF].handler = handler;
+}
+
+// Replies from this SID only depend on the request bytes so can be cached
+void register_cacheable(struct ecu *ecu, int sid) {
+  ecu->sids[sid & 0xFF].cacheable = 1;
+}
+
+struct ecu *lookup_ecu(canid_t can_id) {
+  if(can_id & CAN_EFF_FLAG) return NULL;
+  return ecu_by_id[can_id & CAN_SFF_MASK];
+}
+
+// Each module we simulate and where that info came from.  There could be a
+// lot of overlap and exceptions here. -- Craig
+void register_ecus() {
+  static unsigned char did_0600[30] = { 0x02, 0x01, 0x00, 0x17, 0x26, 0xF2, 0x00, 0x00, 0x5B, 0x00,
+                                        0x12, 0x08, 0x58, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01,
+                                        0x00, 0x01 };
+  struct ecu *ecu;
+
+  // EBCM / GM / Chevy Malibu 2006
+  ecu = register_ecu("EBCM", 0x243, 0x643, 0);
+  register_handler(ecu, UDS_SID_TESTER_PRESENT, ANY_SUBFUNC, handle_tester_present);
+  register_handler(ecu, UDS_SID_GM_READ_DIAG_INFO, ANY_SUBFUNC, handle_gm_read_diag);
+  register_handler(ecu, UDS_SID_RESTART_COMMUNICATIONS, ANY_SUBFUNC, handle_gm_return_to_normal);
+
+  // Body Control Module / GM / Chevy Malibu 2006
+  ecu = register_ecu("BCM", 0x244, 0x644, 0);
+  register_handler(ecu, UDS_SID_TESTER_PRESENT, ANY_SUBFUNC, handle_tester_present);
+  register_handler(ecu, UDS_SID_GM_READ_DIAG_INFO, ANY_SUBFUNC, handle_gm_read_diag);
+  register_handler(ecu, UDS_SID_GM_READ_DATA_BY_ID, ANY_SUBFUNC, handle_gm_read_data_by_id);
+  register_handler(ecu, UDS_SID_GM_READ_DID_BY_ID, ANY_SUBFUNC, handle_gm_read_did_by_id);
+  register_handler(ecu, UDS_SID_RESTART_COMMUNICATIONS, ANY_SUBFUNC, handle_gm_return_to_normal);
+  register_cacheable(ecu, UDS_SID_GM_READ_DID_BY_ID);
+
+  // Power Steering / GM / Chevy Malibu 2006
+  register_ecu("PSCM", 0x24A, 0x64A, 0);
+
+  // Unsure.  Seen RTRs to this when requesting VIN
+  register_ecu("RTR", 0x350, 0x350, 0);
+
+  // VCDS Gateway
+  ecu = register_ecu("VCDS Gateway", 0x710, 0x77A, ECU_LOG_PKT);
+  register_handler(ecu, UDS_SID_DIAGNOSTIC_CONTROL, ANY_SUBFUNC, handle_vcds_dsc);
+  register_handler(ecu, UDS_SID_READ_DATA_BY_ID, ANY_SUBFUNC, handle_vcds_read_data_by_id);
+  register_cacheable(ecu, UDS_SID_DIAGNOSTIC_CONTROL);
+  register_cacheable(ecu, UDS_SID_READ_DATA_BY_ID);
+
+  // Generic OBD-II / UDS engine module.  Sometimes flow control comes here
+  ecu = register_ecu("ECM", 0x7E0, 0x7E8, ECU_LOG_PKT | ECU_CHECK_PCI);
+  register_ecu_alias(ecu, 0x7DF);
+  register_handler(ecu, OBD_MODE_SHOW_CURRENT_DATA, ANY_SUBFUNC, handle_current_data);
+  register_handler(ecu, OBD_MODE_SHOW_FREEZE_FRAME, ANY_SUBFUNC, handle_freeze_frame);
+  register_handler(ecu, OBD_MODE_READ_DTC, ANY_SUBFUNC, handle_stored_codes);
+  register_handler(ecu, OBD_MODE_READ_PENDING_DTC, ANY_SUBFUNC, handle_pending_codes);
+  register_handler(ecu, OBD_MODE_VEHICLE_INFORMATION, ANY_SUBFUNC, handle_vehicle_info);
+  register_handler(ecu, OBD_MODE_READ_PERM_DTC, ANY_SUBFUNC, handle_perm_codes);
+  register_handler(ecu, UDS_SID_DIAGNOSTIC_CONTROL, ANY_SUBFUNC, handle_dsc);
+  register_handler(ecu, UDS_SID_READ_DATA_BY_ID, ANY_SUBFUNC, handle_read_data_by_id);
+  register_handler(ecu, UDS_SID_WRITE_DATA_BY_ID, ANY_SUBFUNC, handle_write_data_by_id);
+  register_handler(ecu, UDS_SID_REQUEST_DOWNLOAD, ANY_SUBFUNC, handle_request_download);
+  register_handler(ecu, UDS_SID_REQUEST_UPLOAD, ANY_SUBFUNC, handle_request_upload);
+  register_handler(ecu, UDS_SID_TRANSFER_DATA, ANY_SUBFUNC, handle_transfer_data);
+  register_handler(ecu, UDS_SID_REQUEST_XFER_EXIT, ANY_SUBFUNC, handle_request_transfer_exit);
+  register_handler(ecu, UDS_SID_READ_DATA_BY_ID_PERIODIC, ANY_SUBFUNC, handle_read_periodic_data);
+  register_handler(ecu, UDS_SID_TESTER_PRESENT, ANY_SUBFUNC, handle_tester_present);
+  register_handler(ecu, UDS_SID_GM_READ_DIAG_INFO, ANY_SUBFUNC, handle_gm_read_diag);
+  register_cacheable(ecu, OBD_MODE_SHOW_CURRENT_DATA);
+  register_cacheable(ecu, OBD_MODE_VEHICLE_INFORMATION);
+  register_cacheable(ecu, UDS_SID_DIAGNOSTIC_CONTROL);
+  register_cacheable(ecu, UDS_SID_READ_DATA_BY_ID);
+  // DIDs based on VCDS responses for now, Note VCDS pads with 55's
+  did_add(ecu, 0xF187, (unsigned char *)"04E906323F ", 11, 0, 0);
+  did_add(ecu, 0xF189, (unsigned char *)"8410", 4, 0, 0);
+  did_add(ecu, 0xF19E, (unsigned char *)"EV_GatewEVConti", 16, 0, 0);
+  did_add(ecu, 0xF1A2, (unsigned char *)"004010", 6, 0, 0);
+  did_add(ecu, 0x0600, did_0600, sizeof(did_0600), 0, 0);
+}
+
+/*
+ * Learned responses.  -L imports a candump -l log of a tester talking to a
+ * real vehicle.  ISO-TP messages are reassembled per CAN ID, each request is
+ * paired with the answer that follows it, and the pairs go into an open
+ * addressed hash table keyed by (request ID, request bytes).  Requests that
+ * match a recorded one are answered from it before any handler runs.
+ */
+uint32_t resp_db_hash(canid_t req_id, unsigned char *data, int len) {
+  uint32_t hash = 2166136261u ^ req_id; // FNV-1a
+  int i;
+  for(i = 0; i < len; i++) hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+// The matching entry, or the free slot where it would go
+struct resp_db_entry *resp_db_slot(uint32_t hash, canid_t req_id, unsigned char *data, int len) {
+  struct resp_db_entry *e;
+  unsigned int slot = hash & (resp_db_slots - 1);
+  while(1) {
+    e = &resp_db[slot];
+    if(!e->data) return e;
+    if(e->hash == hash && e->req_id == req_id && e->req_len == len && !memcmp(e->data, data, len)) return e;
+    slot = (slot + 1) & (resp_db_slots - 1);
+  }
+}
+
+// Doubles the table, keeping it at most half full
+int resp_db_grow() {
+  struct resp_db_entry *old = resp_db;
+  unsigned int i, old_slots = resp_db_slots;
+  resp_db_slots = old_slots ? old_slots * 2 : RESP_DB_MIN_SLOTS;
+  resp_db = calloc(resp_db_slots, sizeof(struct resp_db_entry));
+  if(!resp_db) {
+    perror("resp_db_grow");
+    resp_db = old;
+    resp_db_slots = old_slots;
+    return -1;
+  }
+  for(i = 0; i < old_slots; i++) {
+    if(old[i].data) *resp_db_slot(old[i].hash, old[i].req_id, old[i].data, old[i].req_len) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+// Returns 1 if added, 0 if that request was already recorded
+int resp_db_add(canid_t req_id, unsigned char *req, int req_len, canid_t resp_id, unsigned char *resp, int resp_len) {
+  struct resp_db_entry *e;
+  uint32_t hash = resp_db_hash(req_id, req, req_len);
+  if((resp_db_count + 1) * 2 > resp_db_slots && resp_db_grow() < 0) return 0;
+  e = resp_db_slot(hash, req_id, req, req_len);
+  if(e->data) return 0; // The first answer seen wins
+  e->data = malloc(req_len + resp_len);
+  if(!e->data) return 0;
+  memcpy(e->data, req, req_len);
+  memcpy(e->data + req_len, resp, resp_len);
+  e->hash = hash;
+  e->req_id = req_id;
+  e->resp_id = resp_id;
+  e->req_len = req_len;
+  e->resp_len = resp_len;
+  resp_db_count++;
+  return 1;
+}
+
+// The request bytes of msg without the PCI byte or frame padding
+int msg_payload_len(struct uds_msg *msg) {
+  int len = msg->data[0] ? msg->data[0] & 0x0F : msg->len - 1;
+  if(len > msg->len - 1) len = msg->len - 1;
+  return len;
+}
+
+struct resp_db_entry *resp_db_lookup(struct uds_msg *msg) {
+  struct resp_db_entry *e;
+  int len = msg_payload_len(msg);
+  e = resp_db_slot(resp_db_hash(msg->can_id, &msg->data[1], len), msg->can_id, &msg->data[1], len);
+  return e->data ? e : NULL;
+}
+
+int hex_nibble(char c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// "(1436509052.249713) can0 7E0#0209020000000000" with an optional R/T after
+int learn_parse_line(char *line, struct canfd_frame *frame) {
+  char tok[300], *p;
+  int hi, lo;
+  if(sscanf(line, "(%*[^)]) %*s %299s", tok) != 1) return -1;
+  memset(frame, 0, sizeof(struct canfd_frame));
+  frame->can_id = strtoul(tok, &p, 16);
+  if(*p != '#') return -1;
+  if(p - tok > 3) frame->can_id |= CAN_EFF_FLAG;
+  p++;
+  if(*p == '#') { // CAN FD, a flags nibble comes first
+    frame->flags = CANFD_FDF;
+    p += 2;
+  }
+  if(*p == 'R') return -1;
+  while(frame->len < CANFD_MAX_DLEN && (hi = hex_nibble(p[0])) >= 0 && (lo = hex_nibble(p[1])) >= 0) {
+    frame->data[frame->len++] = (hi << 4) | lo;
+    p += 2;
+  }
+  return 0;
+}
+
+// Feeds a frame to the reassembler for its ID.  Returns the length of a
+// complete message in rx->buf, 0 if there isn't one yet
+int learn_isotp(struct learn_rx *rx, struct canfd_frame *frame) {
+  int len;
+  if(frame->len < 1) return 0;
+  switch(frame->data[0] & 0xF0) {
+    case ISOTP_SINGLE_FRAME:
+      len = frame->data[0];
+      if(len == 0 && frame->len > CAN_MAX_DLEN) { // CAN FD single frame
+        len = frame->data[1];
+        if(len > frame->len - 2) return 0;
+        memcpy(rx->buf, &frame->data[2], len);
+        return len;
+      }
+      if(len == 0 || len > frame->len - 1) return 0;
+      memcpy(rx->buf, &frame->data[1], len);
+      return len;
+    case ISOTP_FIRST_FRAME:
+      rx->size = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+      if(frame->len < 8 || rx->size < 8) {
+        rx->size = 0; // Escape lengths are bigger than we keep
+        return 0;
+      }
+      rx->received = frame->len - 2;
+      if(rx->received > rx->size) rx->received = rx->size;
+      memcpy(rx->buf, &frame->data[2], rx->received);
+      rx->seq = 1;
+      return 0;
+    case ISOTP_CONSECUTIVE_FRAME:
+      if(!rx->size) return 0;
+      if((frame->data[0] & 0x0F) != rx->seq) {
+        rx->size = 0;
+        return 0;
+      }
+      len = rx->size - rx->received;
+      if(len > frame->len - 1) len = frame->len - 1;
+      memcpy(&rx->buf[rx->received], &frame->data[1], len);
+      rx->received += len;
+      rx->seq = (rx->seq + 1) & 0x0F;
+      if(rx->received < rx->size) return 0;
+      len = rx->size;
+      rx->size = 0;
+      return len;
+  }
+  return 0; // Flow control
+}
+
+// Imports a candump log.  Returns -1 if it can't be read
+int resp_db_import(char *file) {
+  static struct learn_rx *rx_by_id[MAX_CAN_ID];
+  struct learn_req pending[LEARN_PENDING];
+  struct learn_req *req;
+  struct canfd_frame frame;
+  unsigned long lines = 0, added = 0, dups = 0, unmatched = 0;
+  unsigned char *msg;
+  char line[512];
+  int i, len, next = 0, id;
+  FILE *fp = fopen(file, "r");
+  if(!fp) {
+    perror(file);
+    return -1;
+  }
+  memset(pending, 0, sizeof(pending));
+  while(fgets(line, sizeof(line), fp)) {
+    lines++;
+    if(learn_parse_line(line, &frame) < 0 || (frame.can_id & CAN_EFF_FLAG)) continue;
+    id = frame.can_id & CAN_SFF_MASK;
+    if(!rx_by_id[id] && !(rx_by_id[id] = calloc(1, sizeof(struct learn_rx)))) break;
+    len = learn_isotp(rx_by_id[id], &frame);
+    if(!len) continue;
+    msg = rx_by_id[id]->buf;
+    if(msg[0] != 0x7F && !(msg[0] & 0x40)) { // A request, remember it until it's answered
+      req = &pending[next++ % LEARN_PENDING];
+      free(req->data);
+      req->data = malloc(len);
+      if(!req->data) break;
+      memcpy(req->data, msg, len);
+      req->len = len;
+      req->can_id = id;
+      continue;
+    }
+    if(msg[0] == 0x7F && len > 2 && msg[2] == 0x78) continue; // Response pending, the real one comes later
+    // Answer to the most recent request for that SID
+    req = NULL;
+    for(i = 1; i <= LEARN_PENDING; i++) {
+      req = &pending[(next - i + LEARN_PENDING * 2) % LEARN_PENDING];
+      if(req->data && req->can_id != id && (msg[0] == 0x7F ? len > 1 && msg[1] == req->data[0] : msg[0] - 0x40 == req->data[0])) break;
+      req = NULL;
+    }
+    if(!req) {
+      unmatched++;
+      continue;
+    }
+    if(resp_db_add(req->can_id, req->data, req->len, id, msg, len)) added++;
+    else dups++;
+    if(!lookup_ecu(req->can_id)) register_ecu("Learned", req->can_id, id, ECU_LOG_PKT);
+    free(req->data);
+    req->data = NULL;
+  }
+  fclose(fp);
+  for(i = 0; i < LEARN_PENDING; i++) free(pending[i].data);
+  for(i = 0; i < MAX_CAN_ID; i++) {
+    free(rx_by_id[i]);
+    rx_by_id[i] = NULL;
+  }
+  plog("Learned %lu responses from %s (%lu lines, %lu repeats, %lu unmatched answers)\n",
+       added, file, lines, dups, unmatched);
+  return 0;
+}
+
+// Answers msg from the learned responses.  Returns 0 if there is no match
+int resp_db_send(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct resp_db_entry *e;
+  if(!resp_db_count) return 0;
+  e = resp_db_lookup(msg);
+  if(!e) return 0;
+  resp_db_hits++;
+  if(verbose > 1) plog("Replying to %s with a learned response\n", ecu->name);
+  if(e->data[e->req_len] == 0x7F && e->resp_len > 2) nrc_sent[e->data[e->req_len + 2]]++;
+  lat_begin(msg);
+  isotp_send_to(can, ecu, (char *)e->data + e->req_len, e->resp_len, e->resp_id);
+  lat_end();
+  return 1;
+}
+
+/*
+ * DID profiles (-P).  One DID per line:
+ *
+ *   <request ID>[:<reply ID>] <DID> <value> [rw [<max length>]]
+ *
+ * The value is hex bytes or a "quoted string".  rw DIDs take writes of the
+ * same length, or of any length up to the max when one is given.  Request IDs
+ * that aren't a known module get one, answering on request ID + 8.  Written
+ * values go back into the profile at exit, or on "save" from the control
+ * socket, so they are still there after a restart.
+ */
+// A "quoted string" or hex bytes.  Returns the length, -1 if it's neither
+int did_parse_value(char **pp, unsigned char *out, int size) {
+  char *p = *pp;
+  int len = 0, hi, lo;
+  if(*p == '"') {
+    for(p++; *p && *p != '"'; p++) {
+      if(len == size) return -1;
+      out[len++] = *p;
+    }
+    if(*p++ != '"') return -1;
+  } else {
+    while((hi = hex_nibble(p[0])) >= 0 && (lo = hex_nibble(p[1])) >= 0) {
+      if(len == size) return -1;
+      out[len++] = hi << 4 | lo;
+      p += 2;
+      if(*p == ' ' && hex_nibble(p[1]) >= 0 && hex_nibble(p[2]) >= 0) p++;
+    }
+    if(!len) return -1;
+  }
+  *pp = p;
+  return len;
+}
+
+int did_load(char *file) {
+  static unsigned char value[ISOTP_FF_DL_MAX];
+  static char line[PROFILE_LINE_MAX];
+  struct ecu *ecu;
+  unsigned long lines = 0, added = 0, bad = 0;
+  char *p, *end;
+  int req_id, resp_id, did, len, flags, max;
+  FILE *fp = fopen(file, "r");
+  if(!fp) {
+    perror(file);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), fp)) {
+    lines++;
+    p = line + strspn(line, " \t");
+    if(*p == '#' || *p == '\n' || *p == '\r' || !*p) continue;
+    req_id = strtoul(p, &end, 16);
+    resp_id = req_id + 8;
+    if(*end == ':') resp_id = strtoul(end + 1, &end, 16);
+    did = strtoul(end, &p, 16);
+    p += strspn(p, " \t");
+    len = (p == end || req_id <= 0 || req_id >= MAX_CAN_ID || did > 0xFFFF) ? -1 : did_parse_value(&p, value, sizeof(value) - 3);
+    if(len < 0) {
+      plog("%s:%lu: bad DID line\n", file, lines);
+      bad++;
+      continue;
+    }
+    flags = max = 0;
+    p += strspn(p, " \t");
+    if(!strncmp(p, "rw", 2)) {
+      flags = DID_WRITABLE;
+      max = strtoul(p + 2, NULL, 0);
+      if(max > len) flags |= DID_VARIABLE;
+      if(max > (int)sizeof(value) - 3) max = sizeof(value) - 3;
+    }
+    ecu = lookup_ecu(req_id);
+    if(!ecu) ecu = register_ecu("Profile", req_id, resp_id, ECU_LOG_PKT);
+    if(!ecu || did_add(ecu, did, value, len, flags, max) < 0) break;
+    if(ecu->sids[UDS_SID_WRITE_DATA_BY_ID].handler != handle_write_data_by_id) {
+      register_handler(ecu, UDS_SID_READ_DATA_BY_ID, ANY_SUBFUNC, handle_read_data_by_id);
+      register_handler(ecu, UDS_SID_WRITE_DATA_BY_ID, ANY_SUBFUNC, handle_write_data_by_id);
+    }
+    added++;
+  }
+  fclose(fp);
+  did_profile = file;
+  plog("Loaded %lu DIDs from %s (%lu lines, %lu bad)\n", added, file, lines, bad);
+  return 0;
+}
+
+// Rewrites the profile with the values written since it was loaded.  Lines
+// of DIDs that weren't written, comments included, are kept as they are and
+// the new file replaces the old one in one rename
+int did_save() {
+  static char line[PROFILE_LINE_MAX];
+  struct ecu *ecu;
+  struct did_rec *r;
+  unsigned char *data;
+  char tmp[512];
+  char *p, *end;
+  FILE *in, *out;
+  int i, req_id, did;
+  if(!did_profile || !did_dirty) return 0;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", did_profile);
+  in = fopen(did_profile, "r");
+  if(!in) {
+    perror(did_profile);
+    return -1;
+  }
+  out = fopen(tmp, "w");
+  if(!out) {
+    perror(tmp);
+    fclose(in);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), in)) {
+    p = line + strspn(line, " \t");
+    r = NULL;
+    ecu = NULL;
+    if(*p != '#') {
+      req_id = strtoul(p, &end, 16);
+      if(*end == ':') strtoul(end + 1, &end, 16);
+      did = strtoul(end, &p, 16);
+      if(p != end && req_id > 0 && req_id < MAX_CAN_ID) ecu = lookup_ecu(req_id);
+      if(ecu) r = did_lookup(ecu, did);
+    }
+    if(!r || !(r->flags & DID_WRITTEN)) {
+      fputs(line, out);
+      continue;
+    }
+    // Same request ID and DID as before, then the value as it is now
+    fwrite(line, 1, p - line, out);
+    data = &ecu->dids->data[r->offset];
+    fputc(' ', out);
+    for(i = 0; i < r->len; i++) fprintf(out, "%02X", data[i]);
+    if(!r->len) fprintf(out, "\"\"");
+    if(r->flags & DID_VARIABLE) fprintf(out, " rw %d\n", r->max);
+    else fprintf(out, " rw\n");
+  }
+  fclose(in);
+  if(fclose(out) != 0 || rename(tmp, did_profile) < 0) {
+    perror(did_profile);
+    unlink(tmp);
+    return -1;
+  }
+  did_dirty = 0;
+  plog("Saved the written DIDs to %s\n", did_profile);
+  return 0;
+}
+
+// Gives a module a region of memory, data must stay mapped until exit
+int mem_add(struct ecu *ecu, uint64_t base, unsigned char *data, uint64_t size, int flags, char *file) {
+  struct mem_region *mem = realloc(ecu->mem, (ecu->nmem + 1) * sizeof(struct mem_region));
+  if(!mem) {
+    perror("mem_add");
+    return -1;
+  }
+  ecu->mem = mem;
+  mem[ecu->nmem].base = base;
+  mem[ecu->nmem].size = size;
+  mem[ecu->nmem].data = data;
+  mem[ecu->nmem].flags = flags;
+  mem[ecu->nmem].file = file;
+  ecu->nmem++;
+  if(ecu->sids[UDS_SID_READ_MEM_BY_ADDRESS].handler != handle_read_mem_by_address) {
+    register_handler(ecu, UDS_SID_READ_MEM_BY_ADDRESS, ANY_SUBFUNC, handle_read_mem_by_address);
+    register_handler(ecu, UDS_SID_WRITE_MEM_BY_ADDRESS, ANY_SUBFUNC, handle_write_mem_by_address);
+    register_handler(ecu, UDS_SID_REQUEST_DOWNLOAD, ANY_SUBFUNC, handle_request_download);
+    register_handler(ecu, UDS_SID_REQUEST_UPLOAD, ANY_SUBFUNC, handle_request_upload);
+    register_handler(ecu, UDS_SID_TRANSFER_DATA, ANY_SUBFUNC, handle_transfer_data);
+    register_handler(ecu, UDS_SID_REQUEST_XFER_EXIT, ANY_SUBFUNC, handle_request_transfer_exit);
+  }
+  return 0;
+}
+
+// -I <request ID>[:<reply ID>]=<file>[@<address>][,shared]
+int mem_map(char *spec) {
+  struct ecu *ecu;
+  struct stat st;
+  uint64_t base = 0;
+  char *file, *end, *p;
+  void *data;
+  int req_id, resp_id, fd, flags = 0;
+  req_id = strtoul(spec, &end, 16);
+  resp_id = req_id + 8;
+  if(*end == ':') resp_id = strtoul(end + 1, &end, 16);
+  if(*end != '=' || req_id <= 0 || req_id >= MAX_CAN_ID) {
+    plog("Bad image %s, expected <request ID>=<file>[@<address>][,shared]\n", spec);
+    return -1;
+  }
+  file = strdup(end + 1);
+  if(!file) return -1;
+  p = strrchr(file, ',');
+  if(p && !strcmp(p, ",shared")) {
+    *p = 0;
+    flags |= MEM_SHARED;
+  }
+  p = strrchr(file, '@');
+  if(p) {
+    *p = 0;
+    base = strtoull(p + 1, NULL, 16);
+  }
+  fd = open(file, (flags & MEM_SHARED) ? O_RDWR : O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0) {
+    perror(file);
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  if(st.st_size == 0) {
+    plog("%s is empty\n", file);
+    close(fd);
+    return -1;
+  }
+  // Private mappings are copy on write, so 0x3D can change them either way
+  data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, (flags & MEM_SHARED) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    perror(file);
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL); // Dump tools read in order
+  ecu = lookup_ecu(req_id);
+  if(!ecu) ecu = register_ecu("Image", req_id, resp_id, ECU_LOG_PKT);
+  if(!ecu || mem_add(ecu, base, data, st.st_size, flags, file) < 0) return -1;
+  plog("Mapped %s at %llX for %s (%llu bytes%s)\n", file, (unsigned long long)base, ecu->name,
+       (unsigned long long)st.st_size, (flags & MEM_SHARED) ? ", shared" : "");
+  return 0;
+}
+
+// Hands a complete request to whatever handler is registered for it
+void dispatch_msg(struct transport *can, struct uds_msg *msg, struct ecu *ecu) {
+  struct sid_entry *entry;
+  entry = &ecu->sids[msg->data[1]];
+  if(entry->subfuncs && msg->len > 2 && entry->subfuncs[msg->data[2]].handler)
+    entry = &entry->subfuncs[msg->data[2]];
+  req_by_sid[msg->data[1]]++;
+  if(camp_mask) camp_request(msg);
+  if(resp_db_send(can, msg, ecu)) {
+    if(camp_mask) camp_request_done();
+    return;
+  }
+  if(entry->handler) lat_begin(msg);
+  // The cache key only holds the first three bytes, longer requests (more than one DID) aren't cached
+  if(entry->handler && entry->cacheable && fuzz_level == 0 && !camp_mask && msg_payload_len(msg) <= 3) {
+    if(!resp_cache_send(can, msg, ecu)) resp_cache_fill(can, msg, ecu, entry->handler);
+  } else if(entry->handler) {
+    entry->handler(can, msg, ecu);
+  } else {
+    if(verbose && !(ecu->flags & ECU_LOG_PKT)) print_msg(msg);
+    if(verbose) plog("Unhandled mode/sid: %02X %s\n", msg->data[1], sid_name(msg->data[1]));
+    unhandled_reqs++;
+  }
+  lat_end();
+  if(camp_mask) camp_request_done();
+}
+
+// Handles the incomming CAN Packets
+void handle_pkt(struct transport *can, struct canfd_frame frame) {
+  struct ecu *ecu;
+  struct uds_msg msg;
+  unsigned char buf[CANFD_MAX_DLEN];
+  if(DEBUG) print_pkt(frame);
+  ecu = lookup_ecu(frame.can_id);
+  if(!ecu) {
+    if (DEBUG) plog("DEBUG: missed ID %02X\n", frame.can_id);
+    return;
+  }
+  if(camp_mask) camp_activity();
+  if(frame.can_id & CAN_RTR_FLAG) {
+    if (verbose) plog("Received a RTR at ID %02X\n", frame.can_id & CAN_SFF_MASK);
+    return;
+  }
+  if(verbose && (ecu->flags & ECU_LOG_PKT)) print_pkt(frame);
+  if(frame.len == 0) return;
+  switch(frame.data[0] & 0xF0) {
+    case ISOTP_FIRST_FRAME:
+      isotp_rx_first(can, ecu, &frame);
+      return;
+    case ISOTP_CONSECUTIVE_FRAME:
+      isotp_rx_consecutive(can, ecu, &frame);
+      return;
+    case ISOTP_FLOW_CONTROL:
+      isotp_handle_fc(can, ecu, &frame);
+      return;
+  }
+  // CAN FD single frame, the length is in the 2nd byte
+  if(frame.data[0] == 0 && frame.len > CAN_MAX_DLEN) {
+    if(frame.data[1] < 8 || frame.data[1] > frame.len - 2) return;
+    buf[0] = 0;
+    memcpy(&buf[1], &frame.data[2], frame.data[1]);
+    msg.can_id = frame.can_id;
+    msg.len = frame.data[1] + 1;
+    msg.data = buf;
+    dispatch_msg(can, &msg, ecu);
+    return;
+  }
+  // Single frames (and GM extended addressing) go straight to the handlers
+  if(ecu->flags & ECU_CHECK_PCI) {
+    if(frame.data[0] == 0) return;
+    if(frame.data[0] > frame.len) return;
+  }
+  msg.can_id = frame.can_id;
+  msg.len = frame.len;
+  msg.data = frame.data;
+  dispatch_msg(can, &msg, ecu);
+}
+
+void handle_pkt_batch(struct transport *can, struct canfd_frame *frames, int count) {
+  int i;
+  for(i = 0; i < count; i++) {
+    rx_cur_ts = rx_ts[i];
+    handle_pkt(can, frames[i]);
+  }
+  rx_cur_ts = 0;
+}
+
+void init_rx_batch(int size) {
+  int i;
+  rx_frames = calloc(size, sizeof(struct canfd_frame));
+  rx_iov = calloc(size, sizeof(struct iovec));
+  rx_msgs = calloc(size, sizeof(struct mmsghdr));
+  rx_addrs = calloc(size, sizeof(struct sockaddr_can));
+  rx_ctrlmsgs = calloc(size, RX_CTRLMSG_SIZE);
+  if(!rx_frames || !rx_iov || !rx_msgs || !rx_addrs || !rx_ctrlmsgs) {
+    perror("init_rx_batch");
+    exit(1);
+  }
+  for(i = 0; i < size; i++) {
+    rx_iov[i].iov_base = &rx_frames[i];
+    rx_iov[i].iov_len = sizeof(struct canfd_frame);
+    rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+    rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_can);
+    rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+    rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    rx_msgs[i].msg_hdr.msg_control = rx_ctrlmsgs + (i * RX_CTRLMSG_SIZE);
+    rx_msgs[i].msg_hdr.msg_controllen = RX_CTRLMSG_SIZE;
   }
 }
 
-// return Mode/SIDs in english
-char *get_mode_str(struct canfd_frame frame) {
-  switch(frame.data[1]) {
-    case OBD_MODE_SHOW_CURRENT_DATA:
-       return "Show current Data";
-       break;
-    case OBD_MODE_SHOW_FREEZE_FRAME:
-       return "Show freeze frame";
-       break;
-    case OBD_MODE_READ_DTC:
-       return "Read DTCs";
-       break;
-    case OBD_MODE_CLEAR_DTC:
-       return "Clear DTCs";
-       break;
-    case OBD_MODE_TEST_RESULTS_NON_CAN:
-       return "Mode Test Results (Non-CAN)";
-       break;
-    case OBD_MODE_TEST_RESULTS_CAN:
-       return "Mode Test Results (CAN)";
-       break;
-    case OBD_MODE_READ_PENDING_DTC:
-       return "Read Pending DTCs";
-       break;
-    case OBD_MODE_CONTROL_OPERATIONS:
-       return "Control Operations";
-       break;
-    case OBD_MODE_VEHICLE_INFORMATION:
-       return "Vehicle Information";
-       break;
-    case OBD_MODE_READ_PERM_DTC:
-       return "Read Permanent DTCs";
-       break;
-    case UDS_SID_DIAGNOSTIC_CONTROL:
-       return "Diagnostic Control";
-       break;
-    case UDS_SID_ECU_RESET:
-       return "ECU Reset";
-       break;
-    case UDS_SID_CLEAR_DTC:
-       return "UDS Clear DTCs";
-       break;
-    case UDS_SID_READ_DTC:
-       return "UDS Read DTCs";
-       break;
-    case UDS_SID_GM_READ_DID_BY_ID:
-       return "Read DID by ID (GM)";
-       break;
-    case UDS_SID_RESTART_COMMUNICATIONS:
-       return "Restore Normal Commnications";
-       break;
-    case UDS_SID_READ_DATA_BY_ID:
-       return "Read DATA By ID";
-       break;
-    case UDS_SID_READ_MEM_BY_ADDRESS:
-       return "Read Memory By Address";
-       break;
-    case UDS_SID_READ_SCALING_BY_ID:
-       return "Read Scalling Data by ID";
-       break;
-    case UDS_SID_SECURITY_ACCESS:
-       return "Security Access";
-       break;
-    case UDS_SID_COMMUNICATION_CONTROL:
-       return "Communication Control";
-       break;
-    case UDS_SID_READ_DATA_BY_ID_PERIODIC:
-       return "Read DATA By ID Periodically";
-       break;
-    case UDS_SID_DEFINE_DATA_ID:
-       return "Define DATA By ID";
-       break;
-    case UDS_SID_WRITE_DATA_BY_ID:
-       return "Write DATA By ID";
-       break;
-    case UDS_SID_IO_CONTROL_BY_ID:
-       return "Input/Output Control By ID";
-       break;
-    case UDS_SID_ROUTINE_CONTROL:
-       return "Routine Control";
-       break;
-    case UDS_SID_REQUEST_DOWNLOAD:
-       return "Request Download";
-       break;
-    case UDS_SID_REQUEST_UPLOAD:
-       return "Request Upload";
-       break;
-    case UDS_SID_TRANSFER_DATA:
-       return "Transfer DATA";
-       break;
-    case UDS_SID_REQUEST_XFER_EXIT:
-       return "Request Transfer Exit";
-       break;
-    case UDS_SID_REQUEST_XFER_FILE:
-       return "Request Transfer File";
-       break;
-    case UDS_SID_WRITE_MEM_BY_ADDRESS:
-       return "Write Memory By Address";
-       break;
-    case UDS_SID_TESTER_PRESENT:
-       return "Tester Present";
-       break;
-    case UDS_SID_ACCESS_TIMING:
-       return "Access Timing";
-       break;
-    case UDS_SID_SECURED_DATA_TRANS:
-       return "Secured DATA Transfer";
-       break;
-    case UDS_SID_CONTROL_DTC_SETTINGS:
-       return "Control DTC Settings";
-       break;
-    case UDS_SID_RESPONSE_ON_EVENT:
-       return "Response On Event";
-       break;
-    case UDS_SID_LINK_CONTROL:
-       return "Link Control";
-       break;
-    case UDS_SID_GM_PROGRAMMED_STATE:
-       return "Programmed State (GM)";
-       break;
-    case UDS_SID_GM_PROGRAMMING_MODE:
-       return "Programming Mode (GM)";
-       break;
-    case UDS_SID_GM_READ_DIAG_INFO:
-       return "Read Diagnostic Information (GM)";
-       break;
-    case UDS_SID_GM_READ_DATA_BY_ID:
-       return "Read DATA By ID (GM)";
-       break;
-    case UDS_SID_GM_DEVICE_CONTROL:
-       return "Device Control (GM)";
-       break;
-    default:
-       printf("Unknown mode/sid (%02X)\n", frame.data[1]);
-       return "";
+// Reads whatever the transport has waiting, up to rx_batch frames
+int recv_batch(struct transport *can) {
+  int i, nframes;
+  nframes = can->recv(can, rx_frames, rx_ts, rx_batch);
+  if(nframes <= 0) return nframes;
+  for(i = 0; i < nframes; i++) {
+    if(rx_frames[i].can_id & CAN_EFF_FLAG) rx_eff++;
+    else rx_by_id[rx_frames[i].can_id & CAN_SFF_MASK]++;
+    if(cap_fd >= 0) cap_frame(&rx_frames[i], rx_ts[i], CAP_RX);
   }
+  rx_wakeups++;
+  rx_total += nframes;
+  return nframes;
 }
 
-// Prints raw packet in ID#DATA format
-void print_pkt(struct canfd_frame frame) {
+/*
+ * Control socket.  A Unix stream socket that takes one command per line,
+ * see ctl_command() or send "help".  It is served from the main loop
+ * but only does work when a client sends something, so the packet path
+ * doesn't pay for it.
+ */
+int ctl_open(char *path, int epfd) {
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(ctl_fd < 0 || bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ctl_fd, CTL_MAX_CLIENTS) < 0) {
+    perror(path);
+    return -1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = ctl_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, ctl_fd, &ev);
+  return 0;
+}
+
+void ctl_close(struct ctl_client *c) {
+  close(c->fd);
+  c->fd = 0;
+}
+
+void ctl_stats(int fd) {
+  char *name;
+  double secs;
   int i;
-  plog("Pkt: %02X#", frame.can_id);
-  for(i = 0; i < frame.len; i++) {
-    plog("%02X ", frame.data[i]);
+  dprintf(fd, "rx_frames %lu\n", rx_total);
+  dprintf(fd, "rx_wakeups %lu\n", rx_wakeups);
+  dprintf(fd, "rx_kernel_drops %u\n", rx_kernel_drops);
+  dprintf(fd, "tx_frames %lu\n", tx_frames);
+  dprintf(fd, "tx_calls %lu\n", tx_calls);
+  dprintf(fd, "tx_errors %lu\n", tx_errors);
+  dprintf(fd, "unhandled_requests %lu\n", unhandled_reqs);
+  dprintf(fd, "isotp_sessions_active %d\n", isotp_sessions_active());
+  dprintf(fd, "periodic_streams %d\n", periodic_count);
+  dprintf(fd, "streamed_replies %d\n", tx_njobs);
+  dprintf(fd, "cache_hits %lu\n", cache_hits);
+  dprintf(fd, "cache_misses %lu\n", cache_misses);
+  dprintf(fd, "learned_responses %u\n", resp_db_count);
+  dprintf(fd, "learned_hits %lu\n", resp_db_hits);
+  dprintf(fd, "did_writes %lu\n", did_writes);
+  dprintf(fd, "mem_reads %lu\n", mem_reads);
+  dprintf(fd, "mem_read_bytes %llu\n", mem_read_bytes);
+  dprintf(fd, "mem_writes %lu\n", mem_writes);
+  for(i = XFER_DOWNLOAD; i < XFER_TYPES; i++) {
+    dprintf(fd, "%s_sessions %lu\n", xfer_names[i], xfer_stats[i].sessions);
+    dprintf(fd, "%s_aborted %lu\n", xfer_names[i], xfer_stats[i].aborted);
+    dprintf(fd, "%s_blocks %lu\n", xfer_names[i], xfer_stats[i].blocks);
+    dprintf(fd, "%s_bytes %llu\n", xfer_names[i], xfer_stats[i].bytes);
+    dprintf(fd, "%s_bytes_per_sec %.0f\n", xfer_names[i], xfer_rate(i));
+  }
+  dprintf(fd, "log_drops %lu\n", log_drops);
+  dprintf(fd, "fuzz_level %d\n", fuzz_level);
+  dprintf(fd, "fuzz_seed %llu\n", (unsigned long long)fuzz_seed);
+  dprintf(fd, "fuzz_case %lu\n", fuzz_case);
+  if(camp_mask) {
+    secs = camp_elapsed();
+    dprintf(fd, "campaign_cases %lu\n", camp_cases);
+    dprintf(fd, "campaign_cases_per_sec %.1f\n", secs > 0 ? camp_cases / secs : 0);
+    dprintf(fd, "campaign_findings %lu\n", camp_findings);
+    dprintf(fd, "campaign_busy_pct %.1f\n", secs > 0 ? camp_busy_ns / 10000000.0 / secs : 0);
+    dprintf(fd, "campaign_tester_wait_pct %.1f\n", secs > 0 ? camp_wait_us / 10000.0 / secs : 0);
+  }
+  dprintf(fd, "vin %s\n", vin);
+  for(i = 0; i < MAX_CAN_ID; i++) {
+    if(rx_by_id[i]) dprintf(fd, "rx_id %03X %lu\n", i, rx_by_id[i]);
+  }
+  if(rx_eff) dprintf(fd, "rx_id EFF %lu\n", rx_eff);
+  for(i = 0; i < MAX_CAN_ID; i++) {
+    if(tx_by_id[i]) dprintf(fd, "tx_id %03X %lu\n", i, tx_by_id[i]);
+  }
+  if(tx_eff) dprintf(fd, "tx_id EFF %lu\n", tx_eff);
+  for(i = 0; i < 256; i++) {
+    if(!req_by_sid[i]) continue;
+    name = sid_name(i);
+    dprintf(fd, "sid %02X %lu %s\n", i, req_by_sid[i], name);
+  }
+  for(i = 0; i < 256; i++) {
+    if(nrc_sent[i]) dprintf(fd, "nrc %02X %lu\n", i, nrc_sent[i]);
   }
-  plog("\n");
 }
 
-// Prints binary data in hex format
-void print_bin(unsigned char *bin, int size) {
+void ctl_command(struct ctl_client *c, char *line) {
+  char *cmd, *arg;
+  static char *vin_buf = NULL;
   int i;
-  for(i = 0; i < size; i++) {
-    plog("%02X ", bin[i]);
+  cmd = strtok(line, " \t\r");
+  arg = strtok(NULL, "\r");
+  if(!cmd) return;
+  if(!strcmp(cmd, "stats")) {
+    ctl_stats(c->fd);
+  } else if(!strcmp(cmd, "fuzz") && arg) {
+    fuzz_level = atoi(arg);
+    resp_cache_flush();
+    if(verbose) plog("Fuzz level set to: %d\n", fuzz_level);
+  } else if(!strcmp(cmd, "vin") && arg) {
+    free(vin_buf);
+    vin_buf = strdup(arg);
+    vin = vin_buf;
+    resp_cache_flush();
+    if(verbose) plog("VIN set to: %s\n", vin);
+  } else if(!strcmp(cmd, "seed") && arg) {
+    fuzz_seed = strtoull(arg, &arg, 0);
+    fuzz_case = *arg == ':' ? strtoul(arg + 1, NULL, 0) - 1 : 0;
+    if(verbose) plog("Fuzz seed set to: %llu\n", (unsigned long long)fuzz_seed);
+  } else if(!strcmp(cmd, "campaign") && arg) {
+    i = strcmp(arg, "off") ? camp_parse(arg) : 0;
+    if(i < 0) {
+      dprintf(c->fd, "ERR unknown strategy in %s\n", arg);
+      return;
+    }
+    camp_mask = i;
+  } else if(!strcmp(cmd, "campaign")) {
+    camp_dump();
+  } else if(!strcmp(cmd, "verbose") && arg) {
+    verbose = atoi(arg);
+  } else if(!strcmp(cmd, "latency")) {
+    lat_dump();
+  } else if(!strcmp(cmd, "flush")) {
+    resp_cache_flush();
+  } else if(!strcmp(cmd, "save")) {
+    if(did_save() < 0) {
+      dprintf(c->fd, "ERR can't save %s\n", did_profile);
+      return;
+    }
+  } else if(!strcmp(cmd, "quit")) {
+    ctl_close(c);
+    return;
+  } else if(!strcmp(cmd, "help")) {
+    dprintf(c->fd, "stats\t\tCounters\nfuzz <level>\tSet the fuzz level\nvin <vin>\tSet the VIN\n"
+                   "seed <seed>[:<case>]\tSet the fuzz seed\ncampaign [<strategies>|off]\tLog the campaign or change its strategies\nverbose <level>\tSet verbosity\nlatency\t\tLog the latency histograms\n"
+                   "flush\t\tDrop cached replies\nsave\t\tSave written DIDs to the profile\nquit\n");
+  } else {
+    dprintf(c->fd, "ERR unknown command %s\n", cmd);
+    return;
   }
-  plog("\n");
+  dprintf(c->fd, "OK\n");
 }
 
-// Handles the incomming CAN Packets
-// Each ID that deals with specific controllers a note is
-// given where that info came from.  There could be a lot of overlap
-// and exceptions here. -- Craig
-void handle_pkt(int can, struct canfd_frame frame) {
-  if(DEBUG) print_pkt(frame);
-  switch(frame.can_id) {
-    case 0x243: // EBCM / GM / Chevy Malibu 2006
-      switch(frame.data[1]) {
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp_to(can, frame, 0x643);
-          break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
-          break;
-        
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x244: // Body Control Module / GM / Chevy Malibu 2006
-      if(frame.data[0] == 0x30) { // Flow control
-        flow_control_push_to(can, 0x644);
-        return;
-      }
-      switch(frame.data[1]) {
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp_to(can, frame, 0x644);
-          break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
-          break;
-        case UDS_SID_GM_READ_DATA_BY_ID:
-          handle_gm_read_data_by_id(can, frame);
-          break;
-        case UDS_SID_GM_READ_DID_BY_ID:
-          handle_gm_read_did_by_id(can, frame);
-          break;
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x24A: // Power Steering / GM / Chevy Malibu 2006
-      switch(frame.data[1]) {
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x350: // Unsure.  Seen RTRs to this when requesting VIN
-      if (frame.can_id & CAN_RTR_FLAG) {
-        if (verbose) plog("Received a RTR at ID %02X\n", frame.can_id);
-      }
-      break;
-    case 0x710: // VCDS
-      if(verbose) print_pkt(frame);
-      handle_vcds_710(can, frame);
-      break;
-    case 0x7df:
-    case 0x7e0:  // Sometimes flow control comes here
-      if(verbose) print_pkt(frame);
-      if(frame.data[0] == 0x30 && gBufLengthRemaining > 0) flow_control_push(can);
-      if(frame.data[0] == 0 || frame.len == 0) return;
-      if(frame.data[0] > frame.len) return;
-      switch (frame.data[1]) {
-        case OBD_MODE_SHOW_CURRENT_DATA:
-          handle_current_data(can, frame);
-          break;
-        case OBD_MODE_SHOW_FREEZE_FRAME: 
-          handle_freeze_frame(can, frame);
-          break;
-        case OBD_MODE_READ_DTC:
-          handle_stored_codes(can, frame);
-          break;
-        case OBD_MODE_READ_PENDING_DTC:
-          handle_pending_codes(can, frame);
-          break;
-        case OBD_MODE_VEHICLE_INFORMATION:
-          handle_vehicle_info(can, frame);
-          break;
-        case OBD_MODE_READ_PERM_DTC:
-          handle_perm_codes(can, frame);
-          break;
-        case UDS_SID_DIAGNOSTIC_CONTROL: // DSC
-          handle_dsc(can, frame);
-          break;
-        case UDS_SID_READ_DATA_BY_ID:
-          handle_read_data_by_id(can, frame);
-          break;
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp(can, frame);
-          break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
-          break;
-        default:
-          //if(verbose) plog("Unhandled mode/sid: %02X\n", frame.data[1]);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    default:
-      if (DEBUG) print_pkt(frame);
-      if (DEBUG) plog("DEBUG: missed ID %02X\n", frame.can_id);
-      break;
+// Handles activity on the control socket or one of its clients
+void ctl_handle(int epfd, int fd) {
+  struct ctl_client *c = NULL;
+  struct epoll_event ev;
+  char *nl;
+  int i, ret;
+  if(fd == ctl_fd) {
+    ret = accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK);
+    if(ret < 0) return;
+    for(i = 0; i < CTL_MAX_CLIENTS; i++) {
+      if(!ctl_clients[i].fd) break;
+    }
+    if(i == CTL_MAX_CLIENTS) {
+      close(ret);
+      return;
+    }
+    ctl_clients[i].fd = ret;
+    ctl_clients[i].len = 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = ret;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ret, &ev);
+    return;
+  }
+  for(i = 0; i < CTL_MAX_CLIENTS; i++) {
+    if(ctl_clients[i].fd == fd) c = &ctl_clients[i];
+  }
+  if(!c) return;
+  ret = read(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+  if(ret <= 0) {
+    if(ret < 0 && errno == EAGAIN) return;
+    ctl_close(c);
+    return;
+  }
+  c->len += ret;
+  c->buf[c->len] = 0;
+  while(c->fd && (nl = strchr(c->buf, '\n'))) {
+    *nl = 0;
+    ctl_command(c, c->buf);
+    c->len -= nl + 1 - c->buf;
+    memmove(c->buf, nl + 1, c->len + 1);
+  }
+  if(c->fd && c->len == sizeof(c->buf) - 1) { // Line too long
+    dprintf(c->fd, "ERR line too long\n");
+    ctl_close(c);
+  }
+}
+
+/*
+ * Microbenchmarks.  Every request below goes through the full receive path
+ * on the loopback transport, flow control included, so the numbers are the
+ * cost of our own protocol code with no kernel involved.  Cacheable
+ * services are answered from the reply cache after the first run, just
+ * like on the bus.
+ */
+struct micro_case micro_cases[] = {
+  { 0x7E0, 3, { 0x02, 0x01, 0x00 } },
+  { 0x7E0, 3, { 0x02, 0x01, 0x01 } },
+  { 0x7E0, 3, { 0x02, 0x02, 0x00 } },
+  { 0x7E0, 2, { 0x01, 0x03 } },
+  { 0x7E0, 2, { 0x01, 0x07 } },
+  { 0x7E0, 3, { 0x02, 0x09, 0x00 } },
+  { 0x7E0, 3, { 0x02, 0x09, 0x02 } },
+  { 0x7E0, 2, { 0x01, 0x0A } },
+  { 0x7E0, 3, { 0x02, 0x10, 0x03 } },
+  { 0x7E0, 4, { 0x03, 0x22, 0xF1, 0x87 } },
+  { 0x7E0, 4, { 0x03, 0x22, 0xF1, 0x89 } },
+  { 0x7E0, 4, { 0x03, 0x22, 0xF1, 0x9E } },
+  { 0x7E0, 4, { 0x03, 0x22, 0x06, 0x00 } },
+  { 0x7E0, 6, { 0x05, 0x22, 0xF1, 0x87, 0xF1, 0x89 } },
+  { 0x7E0, 3, { 0x02, 0x3E, 0x00 } },
+  { 0x7E0, 6, { 0x05, 0x23, 0x12, 0x00, 0x10, 0x20 } },
+  { 0x7E0, 7, { 0x06, 0x23, 0x22, 0x10, 0x00, 0x0F, 0xFF } },
+  { 0x7E0, 6, { 0x05, 0x2A, 0x03, 0x01, 0x02, 0x03 } },
+  { 0x7E0, 3, { 0x02, 0x2A, 0x04 } },
+  { 0x7E0, 4, { 0x03, 0xA9, 0x81, 0x12 } },
+  { 0x243, 4, { 0x03, 0xA9, 0x81, 0x12 } },
+  { 0x244, 3, { 0x02, 0x1A, 0x90 } },
+  { 0x244, 3, { 0x02, 0x1A, 0xB4 } },
+  { 0x244, 3, { 0x02, 0x1A, 0xCB } },
+  { 0x244, 4, { 0x03, 0xAA, 0x01, 0x07 } },
+  { 0x244, 3, { 0x02, 0xAA, 0x00 } },
+  { 0x244, 2, { 0x01, 0x3E } },
+  { 0x710, 3, { 0x02, 0x10, 0x03 } },
+  { 0x710, 4, { 0x03, 0x22, 0xF1, 0x87 } },
+  { 0x710, 4, { 0x03, 0x22, 0xF1, 0x89 } },
+  { 0 }
+};
+
+// One request and, for multi-frame replies, the tester's flow control
+void micro_run(struct transport *tp, struct canfd_frame *req, struct canfd_frame *fc) {
+  struct loop_priv *lp = tp->priv;
+  loop_inject(tp, req);
+  handle_pkt_batch(tp, rx_frames, recv_batch(tp));
+  if((lp->last_tx.data[0] & 0xF0) != ISOTP_FIRST_FRAME) return;
+  lp->last_tx.data[0] = 0;
+  loop_inject(tp, fc);
+  handle_pkt_batch(tp, rx_frames, recv_batch(tp));
+}
+
+unsigned char mem_scratch[0x10000];
+
+// A request with a short PCI length must not get the cached reply of a
+// longer one that its padding happens to match.  Returns -1 if it does
+int micro_check_cache(struct transport *tp) {
+  struct loop_priv *lp = tp->priv;
+  struct canfd_frame req;
+  memset(&req, 0, sizeof(req));
+  req.can_id = 0x7E0;
+  req.len = 8;
+  memcpy(req.data, "\x03\x22\xF1\x87\x55\x55\x55\x55", 8);
+  loop_inject(tp, &req);
+  handle_pkt_batch(tp, rx_frames, recv_batch(tp));
+  req.data[0] = 0x02; // Same bytes, but F1 87 is only padding now
+  loop_inject(tp, &req);
+  handle_pkt_batch(tp, rx_frames, recv_batch(tp));
+  if(lp->last_tx.data[1] != 0x7F || lp->last_tx.data[3] != 0x13) {
+    printf("FAIL: 02 22 F1 87 was answered from the reply cache of 03 22 F1 87\n");
+    return -1;
   }
+  resp_cache_flush();
+  return 0;
+}
+
+int run_microbench(int iterations) {
+  struct transport *tp = loop_open();
+  struct loop_priv *lp;
+  struct micro_case *mc;
+  struct canfd_frame req, fc;
+  struct ecu *ecu;
+  unsigned long frames;
+  uint64_t start, ns;
+  char bytes[32];
+  int i, n;
+  if(!tp) {
+    perror("loop_open");
+    return 1;
+  }
+  lp = tp->priv;
+  init_rx_batch(rx_batch);
+  register_ecus();
+  mem_add(lookup_ecu(0x7E0), 0, mem_scratch, sizeof(mem_scratch), 0, "scratch"); // Something for 0x23 to read
+  if(micro_check_cache(tp) < 0) return 1;
+  printf("%-12s %-4s %-24s %-34s %10s %7s\n", "Module", "ID", "Request", "Service", "ns/req", "frames");
+  for(mc = micro_cases; mc->len; mc++) {
+    ecu = lookup_ecu(mc->req_id);
+    if(!ecu) continue;
+    memset(&req, 0, sizeof(req));
+    req.can_id = mc->req_id;
+    req.len = 8;
+    memcpy(req.data, mc->data, mc->len);
+    memset(&fc, 0, sizeof(fc));
+    fc.can_id = mc->req_id;
+    fc.len = 3;
+    fc.data[0] = ISOTP_FLOW_CONTROL | ISOTP_FC_CTS;
+    micro_run(tp, &req, &fc); // Warm up, fills the reply cache
+    frames = lp->tx_count;
+    start = mono_ns();
+    for(i = 0; i < iterations; i++) micro_run(tp, &req, &fc);
+    ns = mono_ns() - start;
+    frames = lp->tx_count - frames;
+    for(i = 0, n = 0; i < mc->len; i++) n += snprintf(bytes + n, sizeof(bytes) - n, "%02X ", mc->data[i]);
+    printf("%-12s %03X  %-24s %-34s %10.1f %7.1f\n", ecu->name, mc->req_id, bytes,
+           sid_name(mc->data[1]), (double)ns / iterations, (double)frames / iterations);
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
-  int opt, ret;
-  int can;
-  int nbytes;
-  struct ifreq ifr;
-  struct sockaddr_can addr;
-  struct iovec iov;
-  struct msghdr msg;
-  struct canfd_frame frame;
-  char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+  int opt;
+  struct transport *can;
+  int nframes;
   struct sigaction act;
-  struct timeval timeo;
-  fd_set rdfs;
+  struct epoll_event ev, events[MAX_EVENTS];
+  char *cap_file = NULL;
+  char *ctl_path = NULL;
+  char *replay_file = NULL;
+  char *camp_list = NULL;
+  char *profile = NULL;
+  char *learn_files[MAX_LEARN_FILES];
+  char *images[MAX_IMAGES];
+  char *p;
+  int nlearn = 0;
+  int nimages = 0;
+  int micro = 0;
+  int epfd, tfd;
+  int i, nevents;
+  uint64_t expirations;
 
   verbose = 0;
+  memset(&act, 0, sizeof(act));
   act.sa_handler = intHandler;
   sigaction(SIGINT, &act, NULL);
   sigaction(SIGHUP, &act, NULL);
-  srand(time(NULL));
+  act.sa_handler = usr1Handler;
+  sigaction(SIGUSR1, &act, NULL);
+  fuzz_seed = ((uint64_t)time(NULL) << 20) ^ getpid();
 
-  while ((opt = getopt(argc, argv, "cV:zl:vFh?")) != -1) {
+  while ((opt = getopt(argc, argv, "cV:zl:vFb:Aftw:x:X:S:r:M:L:P:I:D:T:s:C:O:h?")) != -1) {
     switch(opt) {
         case 'c':
           keep_spec = 1;
@@ -1438,6 +4875,66 @@ int main(int argc, char *argv[]) {
         case 'z':
           fuzz_level++;
           break;
+        case 's':
+          fuzz_seed = strtoull(optarg, &p, 0);
+          if(*p == ':') fuzz_case = strtoul(p + 1, NULL, 0) - 1; // Next case is the one asked for
+          break;
+        case 'C':
+          camp_mask = camp_parse(optarg);
+          if(camp_mask <= 0) usage(argv[0], "Campaign strategies are all or length,seq,oversize,undersize,nrc,dtc");
+          camp_list = optarg;
+          break;
+        case 'O':
+          camp_dir = optarg;
+          break;
+        case 'f':
+          can_fd = 1;
+          break;
+        case 't':
+          log_timestamps = 1;
+          break;
+        case 'w':
+          cap_file = optarg;
+          break;
+        case 'S':
+          ctl_path = optarg;
+          break;
+        case 'x':
+          return cap_convert(optarg, 0) < 0;
+        case 'X':
+          return cap_convert(optarg, 1) < 0;
+        case 'r':
+          replay_file = optarg;
+          break;
+        case 'M':
+          micro = atoi(optarg);
+          if(micro < 1) usage(argv[0], "Need at least one iteration");
+          break;
+        case 'L':
+          learn_files[nlearn++] = optarg;
+          if(nlearn == MAX_LEARN_FILES) usage(argv[0], "Too many logs to learn from");
+          break;
+        case 'P':
+          profile = optarg;
+          break;
+        case 'I':
+          images[nimages++] = optarg;
+          if(nimages == MAX_IMAGES) usage(argv[0], "Too many memory images");
+          break;
+        case 'D':
+          xfer_dir = optarg;
+          break;
+        case 'T':
+          xfer_block_max = atoi(optarg);
+          if(xfer_block_max < 3 || xfer_block_max > 0xFFFF) usage(argv[0], "Block length must be 3 to 65535");
+          break;
+        case 'A':
+          no_filters = 1;
+          break;
+        case 'b':
+          rx_batch = atoi(optarg);
+          if(rx_batch < 1 || rx_batch > MAX_RX_BATCH) usage(argv[0], "Batch size must be between 1 and 1024");
+          break;
         case 'h':
         case '?':
         default:
@@ -1446,69 +4943,121 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (optind >= argc) usage(argv[0], "You must specify at least one can device");
+  if (micro) return run_microbench(micro);
+  if (optind >= argc && !replay_file) usage(argv[0], "You must specify at least one can device");
 
-  // Create a new raw CAN socket
-  can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-  if(can < 0) usage(argv[0], "Couldn't create raw socket");
+  log_start();
 
-  addr.can_family = AF_CAN;
-  memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
-  strncpy(ifr.ifr_name, argv[optind], strlen(argv[optind]));
-  if (verbose) plog("Using CAN interface %s\n", ifr.ifr_name);
-  if (ioctl(can, SIOCGIFINDEX, &ifr) < 0) {
-    perror("SIOCGIFINDEX");
-    exit(1);
+  if (replay_file) {
+    if (verbose) plog("Replaying %s\n", replay_file);
+    can = replay_open(replay_file);
+  } else {
+    if (verbose) plog("Using CAN interface %s\n", argv[optind]);
+    can = socketcan_open(argv[optind]);
   }
-  addr.can_ifindex = ifr.ifr_ifindex;
+  if (!can) return 1;
 
-  if (bind(can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        return 1;
+  if (cap_file) {
+    if (cap_open(cap_file, can->name) < 0) return 1;
+    if (verbose) plog("Capturing to %s\n", cap_file);
   }
 
-  iov.iov_base = &frame;
-  iov.iov_len = sizeof(frame);
-  msg.msg_name = &addr;
-  msg.msg_namelen = sizeof(addr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = &ctrlmsg;
-  msg.msg_controllen = sizeof(ctrlmsg);
-  msg.msg_flags = 0;
+  init_rx_batch(rx_batch);
 
   if(verbose) plog("Fuzz level set to: %d\n", fuzz_level);
-  gettimeofday(&start_tv, NULL);
+  if(fuzz_level || camp_mask) plog("Fuzz seed %llu, first case %lu\n", (unsigned long long)fuzz_seed, fuzz_case + 1);
+  if(camp_mask) plog("Fuzz campaign: %s, findings are saved to %s\n", camp_list, camp_dir);
+  register_ecus();
+  if(profile && did_load(profile) < 0) return 1;
+  for(i = 0; i < nimages; i++) {
+    if(mem_map(images[i]) < 0) return 1;
+  }
+  for(i = 0; i < nlearn; i++) {
+    if(resp_db_import(learn_files[i]) < 0) return 1;
+  }
+
+  epfd = epoll_create1(0);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if(epfd < 0 || tfd < 0) {
+    perror("epoll/timerfd");
+    return 1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if(can->fd >= 0) {
+    ev.data.fd = can->fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, can->fd, &ev);
+  }
+  ev.data.fd = tfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+  if(ctl_path && ctl_open(ctl_path, epfd) < 0) return 1;
+
   running = 1;
   while(running) {
-    FD_ZERO(&rdfs);
-    FD_SET(can, &rdfs);
-  
-    timeo.tv_sec  = 0;
-    timeo.tv_usec = 10000 * 20; // 20 ms  
-
-    if ((ret = select(can+1, &rdfs, NULL, NULL, &timeo)) < 0) {
-      running = 0;
+    if(filters_dirty) update_can_filters(can);
+    // Sleep until a frame arrives or the next periodic/ISO-TP deadline.
+    // Transports without an fd are polled instead
+    arm_timer(tfd, next_deadline());
+    if ((nevents = epoll_wait(epfd, events, MAX_EVENTS, can->fd < 0 ? 0 : -1)) < 0) {
+      if(errno != EINTR) running = 0;
       continue;
     }
 
-    if (FD_ISSET(can, &rdfs)) {
-      nbytes = recvmsg(can, &msg, 0);
-      if (nbytes < 0) {
-        perror("read");
-        return 1;
-      }
-      if ((size_t)nbytes != CAN_MTU) {
-        fprintf(stderr, "read: incomplete CAN frame\n");
-        return 1;
+    for(i = 0; i < nevents; i++) {
+      if(events[i].data.fd == can->fd) {
+        nframes = recv_batch(can);
+        if (nframes < 0) {
+          perror("read");
+          return 1;
+        }
+        handle_pkt_batch(can, rx_frames, nframes);
+      } else if(events[i].data.fd == tfd) {
+        if(read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("timerfd");
+      } else {
+        ctl_handle(epfd, events[i].data.fd);
       }
-      handle_pkt(can, frame);
+    }
+    if(can->fd < 0) {
+      handle_pkt_batch(can, rx_frames, recv_batch(can));
+      if(can->closed) running = 0;
     }
 
-    handle_pending_data(can);
+    isotp_poll(can);
+    handle_periodic(can);
+    handle_jobs(can);
+    if(camp_mask) camp_poll();
+    if(lat_dump_requested) {
+      lat_dump_requested = 0;
+      lat_dump();
+    }
   }
 
-  plog("Got Interrupt.  Shutting down gracefully\n");
+  if(can->closed) plog("End of replay.  Shutting down\n");
+  else plog("Got Interrupt.  Shutting down gracefully\n");
+  if(tx_calls) plog("Sent %lu frames in %lu calls, %lu write errors%s%s\n",
+                    tx_frames, tx_calls, tx_errors, tx_errors ? ": " : "",
+                    tx_errors ? strerror(tx_last_errno) : "");
+  if(rx_wakeups) plog("Received %lu frames in %lu wakeups (%.2f frames/wakeup)\n",
+                      rx_total, rx_wakeups, (double)rx_total / rx_wakeups);
+  if(rx_kernel_drops) plog("Kernel dropped %u frames (receive queue full)\n", rx_kernel_drops);
+  if(cap_fd >= 0) plog("Captured %lu frames\n", cap_frames);
+  cap_close();
+  print_jitter("Periodic data", &periodic_jitter);
+  print_jitter("Streamed reply", &job_jitter);
+  print_jitter("ISOTP", &isotp_jitter);
+  if(cache_hits + cache_misses) plog("Reply cache: %lu hits, %lu misses\n", cache_hits, cache_misses);
+  if(resp_db_hits) plog("Answered %lu requests from learned responses\n", resp_db_hits);
+  if(mem_reads + mem_writes) plog("Memory: %lu reads (%llu bytes), %lu writes\n", mem_reads, mem_read_bytes, mem_writes);
+  for(i = XFER_DOWNLOAD; i < XFER_TYPES; i++) {
+    if(xfer_stats[i].sessions) plog("%lu %ss, %llu bytes in %lu blocks, %.0f bytes/s\n", xfer_stats[i].sessions,
+                                    xfer_names[i], xfer_stats[i].bytes, xfer_stats[i].blocks, xfer_rate(i));
+  }
+  camp_dump();
+  lat_dump();
+  did_save();
+  if(ctl_path) unlink(ctl_path);
+  log_stop();
+  if(log_drops) plog("Logger dropped %lu records\n", log_drops);
   if(plogfp) fclose(plogfp);
 
 }
@@ -66,6 +66,418 @@
 #define DTC_CURRENT_DTC_SINCE_POWER       64
 #define DTC_WARNING_INDICATOR_STATE       128
 
-/* Periodic Data Message types */
-#define PENDING_READ_DATA_BY_ID_GM         1
+/* UDS 0x2A transmission modes */
+#define UDS_PERIODIC_SLOW                 0x01
+#define UDS_PERIODIC_MEDIUM               0x02
+#define UDS_PERIODIC_FAST                 0x03
+#define UDS_PERIODIC_STOP                 0x04
 
+/* Periodic data stream types */
+#define PERIODIC_GM                       0 // GM 0xAA, sent on the GM raw reply ID
+#define PERIODIC_UDS                      1 // UDS 0x2A, sent on the module's reply ID
+
+/* Fuzz data generator state (xoshiro256**) */
+struct fuzz_rng {
+  uint64_t s[4];
+};
+
+/* Fuzz campaign (-C) strategies, bit n of the strategy mask enables n */
+#define FUZZ_LENGTH                       0 // Lie about the length in the SF/FF PCI
+#define FUZZ_SEQ                          1 // Bad consecutive frame sequence number
+#define FUZZ_OVERSIZE                     2 // Random bytes past the real reply
+#define FUZZ_UNDERSIZE                    3 // Reply cut short
+#define FUZZ_NRC                          4 // Negative response with a reserved NRC
+#define FUZZ_DTC_COUNT                    5 // DTC count that disagrees with the DTCs sent
+#define FUZZ_STRATEGIES                   6
+#define CAMP_TABLE_SIZE                   512  // Must be a power of 2
+#define CAMP_HISTORY                      8    // Recent cases written out with a finding
+#define CAMP_SAVE_BYTES                   64   // Request/reply bytes kept per case
+#define CAMP_SILENCE_MS                   5000 // Tester quiet this long after a case is a hang
+#define CAMP_RESET_MS                     2000 // Session restarted this soon after a case
+#define CAMP_TP_MISSES                    3    // TesterPresent intervals missed
+
+/* Strategies run against one (request CAN ID, SID) */
+struct camp_entry {
+  canid_t can_id;
+  int sid;
+  int next; // Strategy to try next
+  unsigned long runs[FUZZ_STRATEGIES];
+  unsigned long findings[FUZZ_STRATEGIES];
+};
+
+/* A fuzzed reply, kept so a finding can name the case that caused it */
+struct camp_case {
+  struct camp_entry *entry;
+  unsigned long fuzz_case; // First case of the request, replay with -s seed:case
+  int strategy;
+  uint64_t sent_us;
+  canid_t req_id;
+  canid_t resp_id;
+  int req_len;
+  int resp_len;  // Real length, only CAMP_SAVE_BYTES are kept
+  unsigned char req[CAMP_SAVE_BYTES];
+  unsigned char resp[CAMP_SAVE_BYTES];
+};
+
+/* ISO-TP (ISO 15765-2) */
+#define ISOTP_SINGLE_FRAME                0x00
+#define ISOTP_FIRST_FRAME                 0x10
+#define ISOTP_CONSECUTIVE_FRAME           0x20
+#define ISOTP_FLOW_CONTROL                0x30
+#define ISOTP_FC_CTS                      0 // Continue To Send
+#define ISOTP_FC_WAIT                     1
+#define ISOTP_FC_OVERFLOW                 2
+#define ISOTP_N_BS_MS                     1000 // Max wait for a flow control frame
+#define ISOTP_N_CR_MS                     1000 // Max wait for the next consecutive frame
+#define ISOTP_MAX_WFT                     10   // FC Wait frames allowed in a row
+#define ISOTP_FF_DL_MAX                   4095 // Largest 12 bit first frame length
+#define ISOTP_MAX_PDU                     (1024 * 1024) // With the 32 bit escape length
+#define ISOTP_MAX_SESSIONS                64
+
+/* ISO-TP transfer states */
+#define ISOTP_IDLE                        0
+#define ISOTP_WAIT_FC                     1 // Sent a FF or a full block
+#define ISOTP_SENDING                     2 // Pacing consecutive frames by STmin
+#define ISOTP_RECEIVING                   3
+
+/* ECU dispatch table */
+#define MAX_CAN_ID                        (CAN_SFF_MASK + 1) // 11-bit IDs only
+#define ANY_SUBFUNC                       -1
+
+/* ECU flags */
+#define ECU_LOG_PKT                       1 // Print every packet when verbose
+#define ECU_CHECK_PCI                     2 // Drop frames with a bogus single frame PCI
+
+/* Reply cache */
+#define RESP_CACHE_MAX                    64 // Entries per module
+
+/* A complete diagnostic request.  data[] keeps the single frame layout so the
+   SID is always data[1].  Reassembled multi-frame requests have data[0] = 0 */
+struct uds_msg {
+  canid_t can_id;
+  int len; // Bytes in data[] including data[0]
+  unsigned char *data;
+};
+
+/* Where frames come from and go to: a SocketCAN interface, the in-memory
+   loopback used by the microbenchmarks, or a capture being replayed */
+struct transport {
+  char *name;
+  int fd;     // Waited on with epoll, -1 to call recv() every loop instead
+  int closed; // Nothing more will arrive (end of a replay)
+  int (*send)(struct transport *, struct canfd_frame *, int);
+  int (*recv)(struct transport *, struct canfd_frame *, uint64_t *, int); // Also fills in rx timestamps
+  int (*set_filters)(struct transport *, struct can_filter *, int);       // Optional
+  void *priv;
+};
+
+/* Loopback transport */
+#define LOOP_RING_SIZE                    256 // Must be a power of 2
+
+struct loop_priv {
+  struct canfd_frame rx[LOOP_RING_SIZE]; // Injected, waiting to be received
+  unsigned int rx_head;
+  unsigned int rx_tail;
+  struct canfd_frame last_tx;
+  unsigned long tx_count;
+};
+
+/* A request run by the microbenchmarks */
+struct micro_case {
+  int req_id;
+  int len;
+  unsigned char data[8]; // Single frame including the PCI byte
+};
+
+struct ecu;
+typedef void (*uds_handler)(struct transport *, struct uds_msg *, struct ecu *);
+
+struct sid_entry {
+  uds_handler handler;
+  struct sid_entry *subfuncs; // Optional, indexed by the sub-function byte
+  int cacheable;              // Replies never change so they can be cached
+};
+
+/* Long raw replies, sent a frame at a time from the main loop */
+#define GM_MAX_DPIDS                      8 // DPIDs in one GM 0xAA request
+#define TX_JOB_MAX                        32
+#define JOB_GM_DTC                        0 // GM 0xA9 DTCs by mask, then the closing frame
+#define JOB_GM_DATA                       1 // GM 0xAA one response, a frame per DPID
+
+struct tx_job {
+  struct ecu *ecu;
+  int sid;            // A new request for this SID, or a stop, cancels the job
+  int type;
+  struct canfd_frame frame; // Reply ID and the bytes that don't change
+  unsigned char dpids[GM_MAX_DPIDS];
+  int ndpids;
+  int left;           // Frames to go, not counting a closing frame
+  long gap_us;
+  uint64_t due;
+  struct fuzz_rng rng; // Its own fuzz case, other cases run while it is going
+};
+
+/* A reply that was already built and split into wire frames */
+struct resp_cache {
+  uint32_t key;   // Request length and first three bytes
+  int dest;
+  struct canfd_frame *frames;
+  int nframes;
+  int isotp;      // Multi-frame ISO-TP message, needs flow control
+};
+
+/* Data identifiers */
+#define DID_WRITABLE                      1 // Takes 0x2E writes
+#define DID_VARIABLE                      2 // Writes may change the length, up to max
+#define DID_WRITTEN                       4 // Changed since the profile was loaded
+
+struct did_rec {
+  uint16_t did;
+  uint16_t flags;
+  uint16_t len;
+  uint16_t max;      // Room for the value in the data arena
+  uint32_t offset;   // Where the value is in did_table.data
+};
+
+/* A module's DIDs, sorted by DID for binary search */
+struct did_table {
+  struct did_rec *recs;
+  int count;
+  int size;
+  int sorted;        // Cleared by did_add(), sorted again on the next lookup
+  unsigned char *data;
+  uint32_t data_len;
+  uint32_t data_size;
+};
+
+/* Memory images (-I) */
+#define MEM_SHARED                        1 // Writes go back to the file
+
+struct mem_region {
+  uint64_t base;     // Address of the first byte
+  uint64_t size;
+  unsigned char *data;
+  int flags;
+  char *file;
+};
+
+/* RequestDownload / RequestUpload */
+#define XFER_DOWNLOAD                     1
+#define XFER_UPLOAD                       2
+#define XFER_TYPES                        3
+#define XFER_BLOCK_MAX                    4095 // Default maxNumberOfBlockLength, fits a 12 bit first frame
+#define XFER_IDLE_MS                      5000 // A new request may take over a transfer idle this long
+
+struct xfer {
+  int type;          // 0 when there is no transfer
+  uint64_t addr;
+  uint64_t size;
+  uint64_t done;     // Bytes transferred
+  unsigned long blocks;
+  int bsc;           // blockSequenceCounter the next block must have
+  int max_block;     // maxNumberOfBlockLength we offered, SID and counter included
+  unsigned char *mem; // Image region the data goes to or comes from, NULL for fd
+  uint64_t block_off; // Last upload block, sent again if the tester repeats the request
+  int block_len;
+  int block_fuzzed;  // The last block is in fuzz_buf rather than the image
+  unsigned char *fuzz_buf;
+  int fuzz_size;
+  int fd;            // Download file, -1 to count and drop the data
+  uint64_t start_us;
+  uint64_t last_us;  // Last block
+};
+
+struct xfer_stats {
+  unsigned long sessions;
+  unsigned long aborted;
+  unsigned long blocks;
+  unsigned long long bytes;
+  uint64_t busy_us;  // From the request to the last block of every transfer
+};
+
+/* A simulated module.  Requests come in on req_id and we answer on resp_id */
+struct ecu {
+  char *name;
+  int req_id;
+  int resp_id;
+  int flags;
+  struct sid_entry sids[256];
+  struct resp_cache *cache;
+  int ncache;
+  struct periodic **periodic; // Streams by DID, allocated on first use
+  struct did_table *dids;
+  struct mem_region *mem;
+  int nmem;
+  struct xfer *xfer;
+};
+
+/* One DID sent at a fixed rate until the tester stops it */
+struct periodic {
+  uint64_t due;     // CLOCK_MONOTONIC usecs
+  long period_us;
+  int heap_idx;
+  int type;
+  canid_t can_id;   // Sent on
+  unsigned char did;
+  struct ecu *ecu;
+};
+
+/* Responses learned from candump logs */
+#define RESP_DB_MIN_SLOTS                 1024 // Must be a power of 2
+#define LEARN_PENDING                     16   // Requests waiting for an answer while importing
+
+/* One recorded transaction, looked up by the request ID and bytes */
+struct resp_db_entry {
+  uint32_t hash;
+  canid_t req_id;
+  canid_t resp_id;
+  int req_len;
+  int resp_len;
+  unsigned char *data; // Request bytes then response bytes, NULL for a free slot
+};
+
+/* ISO-TP reassembly of one CAN ID while importing a log */
+struct learn_rx {
+  int size;
+  int received;
+  int seq;
+  unsigned char buf[ISOTP_FF_DL_MAX];
+};
+
+/* A request from the log that has not been answered yet */
+struct learn_req {
+  canid_t can_id;
+  int len;
+  unsigned char *data;
+};
+
+/* Outgoing multi-frame message */
+struct isotp_tx {
+  int state;
+  unsigned char *buf; // Copy of the message, frames are built as they go out
+  int buf_size;
+  int size;
+  int offset;        // Next payload byte to send
+  int seq;           // Next consecutive frame sequence number
+  int seq_fault;     // Consecutive frames left before the sequence jumps (fuzzing), 0 = never
+  int seq_jump;
+  struct canfd_frame *frames; // Prebuilt frames from the reply cache instead of buf
+  unsigned char *ref; // Bytes past ref_skip come from here instead of buf (mmap'd images)
+  int ref_skip;
+  int nframes;
+  int next;
+  struct lat_entry *lat; // Request this is the reply to, timed when the last frame goes
+  uint64_t lat_ts;
+  int block_size;    // BS from the last flow control, 0 = no limit
+  int block_left;
+  long stmin_us;
+  int wait_frames;   // FC Wait frames received in a row
+  uint64_t deadline; // Next CF due or N_Bs timeout (CLOCK_MONOTONIC usecs)
+};
+
+/* Incoming multi-frame request */
+struct isotp_rx {
+  int state;
+  canid_t can_id;
+  unsigned char *buf; // buf[0] stands in for the PCI byte
+  int buf_size;
+  int size;
+  int received;
+  int seq;
+  uint64_t deadline; // N_Cr timeout
+};
+
+/* Transfer state for one (request ID, response ID) pair */
+struct isotp_session {
+  int req_id;
+  int resp_id;
+  struct isotp_tx tx;
+  struct isotp_rx rx;
+};
+
+/* Lateness of timer driven transmits */
+struct jitter_stats {
+  unsigned long count;
+  uint64_t total_us;
+  uint64_t max_us;
+};
+
+/* Async logger */
+#define LOG_RING_SLOTS                    4096 // Must be a power of 2
+#define LOG_MAX_ARGS                      8
+#define LOG_DATA_MAX                      256  // Frame bytes or copied strings
+#define LOG_LINE_MAX                      2048
+
+/* Log record types */
+#define LOG_TEXT                          0 // plog() format and arguments
+#define LOG_PKT                           1 // Pkt: ID#DATA
+#define LOG_BIN                           2 // Hex dump
+
+struct log_rec {
+  uint64_t ts;
+  int type;
+  char *fmt;
+  int nargs;
+  union {
+    long long i; // Integers are widened, %s is an offset into data[]
+    double f;
+  } args[LOG_MAX_ARGS];
+  canid_t can_id;
+  int len; // Bytes used in data[]
+  unsigned char data[LOG_DATA_MAX];
+};
+
+/* Capture file.  A cap_header, then a cap_rec and len data bytes per frame.
+   Fields are in host byte order */
+#define CAP_MAGIC                         "UDSCAP01"
+#define CAP_BUF_SIZE                      (256 * 1024)
+#define CAP_RX                            0
+#define CAP_TX                            1
+#define PCAP_MAGIC_NS                     0xa1b23c4d
+#define PCAP_LINKTYPE_CAN                 227 // LINKTYPE_CAN_SOCKETCAN
+
+struct cap_header {
+  char magic[8];
+  char ifname[16];
+};
+
+struct cap_rec {
+  uint64_t ts_ns;   // CLOCK_REALTIME
+  uint32_t can_id;
+  uint8_t len;
+  uint8_t flags;    // canfd_frame flags
+  uint8_t dir;      // CAP_RX or CAP_TX
+  uint8_t pad;
+};
+
+/* Latency histograms */
+#define LAT_SUB_BITS                      4    // 16 buckets per power of two
+#define LAT_BUCKETS                       560  // Up to ~2^34 us
+#define LAT_TABLE_SIZE                    512  // Must be a power of 2
+#define LAT_FC_TO_CF                      0x100 // Pseudo SIDs for flow control turnaround
+#define LAT_FF_TO_FC                      0x101
+
+struct lat_hist {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint32_t buckets[LAT_BUCKETS];
+};
+
+/* Timings for one (request CAN ID, SID) */
+struct lat_entry {
+  canid_t can_id;
+  int sid;
+  struct lat_hist first; // Request to the first reply frame
+  struct lat_hist last;  // Request to the last reply frame
+};
+
+/* Control socket */
+#define CTL_MAX_CLIENTS                   8
+
+struct ctl_client {
+  int fd; // 0 when the slot is free
+  int len;
+  char buf[256];
+};